@@ -0,0 +1,555 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2017 David Gwynne <dlg@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * benchmarks for the dispatch paths.
+ *
+ * pipes	the libevent chained pipes benchmark. -n socketpairs each
+ *		have a read event, -a of them are written to, and each
+ *		read writes to the next pair until -w writes are done.
+ * timers	-n timers are re-armed -r times each with random timeouts,
+ *		then all of them are set to expire and run.
+ * signals	a signal handler raises its signal again until it has
+ *		been delivered -n times.
+ * churn	-n read events are added and deleted -r times, then added
+ *		once more and dispatched with one of them readable.
+ *
+ * each benchmark is run for -i iterations, and the latency of the
+ * iterations and the number of events handled per second is reported.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <err.h>
+
+#include "minevent.h"
+
+#ifndef __dead
+#define __dead __attribute__((__noreturn__))
+#endif
+
+#ifndef BENCH_BACKEND
+#define BENCH_BACKEND	"default"
+#endif
+
+struct bench {
+	const char	*b_name;
+	int		(*b_init)(void);
+	int		(*b_run)(unsigned long long *);
+	void		(*b_fini)(void);
+};
+
+static int	pipes_init(void);
+static int	pipes_run(unsigned long long *);
+static void	pipes_fini(void);
+static int	timers_init(void);
+static int	timers_run(unsigned long long *);
+static void	timers_fini(void);
+static int	signals_init(void);
+static int	signals_run(unsigned long long *);
+static void	signals_fini(void);
+static int	churn_init(void);
+static int	churn_run(unsigned long long *);
+static void	churn_fini(void);
+
+static const struct bench benches[] = {
+	{ "pipes",	pipes_init,	pipes_run,	pipes_fini },
+	{ "timers",	timers_init,	timers_run,	timers_fini },
+	{ "signals",	signals_init,	signals_run,	signals_fini },
+	{ "churn",	churn_init,	churn_run,	churn_fini },
+};
+
+#define BENCH_MAX	(1 << 24)
+
+#define nitems(_a)	(sizeof((_a)) / sizeof((_a)[0]))
+
+static struct event_base *base;
+static unsigned int iterations = 100;
+static unsigned int num = 1000;
+static unsigned int num_active = 1;
+static unsigned int num_writes = 1000;
+static unsigned int rounds = 4;
+static struct timeval *tick = NULL;
+
+static int *pairs;
+static struct event *events;
+static unsigned int count, writes, fired;
+
+__dead static void
+usage(void)
+{
+	extern char *__progname;
+
+	fprintf(stderr, "usage: %s [-a active] [-i iterations] [-n num] "
+	    "[-r rounds]\n"
+	    "\t[-t tick] [-w writes] pipes | timers | signals | churn | all\n",
+	    __progname);
+
+	exit(1);
+}
+
+static uint64_t
+bench_nsec(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		err(1, "clock_gettime");
+
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static unsigned int
+bench_num(const char *arg, unsigned int min)
+{
+	unsigned long n;
+	char *end;
+
+	/* strtonum isnt everywhere */
+	errno = 0;
+	n = strtoul(arg, &end, 10);
+	if (*arg == '\0' || *end != '\0' || errno != 0 ||
+	    n < min || n > BENCH_MAX)
+		errx(1, "%s: invalid number", arg);
+
+	return (n);
+}
+
+static int
+bench_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return ((x > y) - (x < y));
+}
+
+static void
+bench_pairs(unsigned int n)
+{
+	struct rlimit rl;
+	unsigned int i;
+
+	rl.rlim_cur = rl.rlim_max = n * 2 + 64;
+	if (setrlimit(RLIMIT_NOFILE, &rl) == -1)
+		err(1, "setrlimit %u", n * 2 + 64);
+
+	pairs = reallocarray(NULL, n * 2, sizeof(*pairs));
+	if (pairs == NULL)
+		err(1, "pairs");
+
+	events = reallocarray(NULL, n, sizeof(*events));
+	if (events == NULL)
+		err(1, "events");
+
+	for (i = 0; i < n; i++) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, &pairs[i * 2]) == -1)
+			err(1, "socketpair");
+	}
+}
+
+static void
+bench_pairs_free(unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n * 2; i++)
+		close(pairs[i]);
+
+	free(events);
+	free(pairs);
+}
+
+static void
+bench_run(const struct bench *b)
+{
+	unsigned long long total = 0, nevents;
+	uint64_t *lat, sum = 0, start;
+	unsigned int i;
+
+	lat = reallocarray(NULL, iterations, sizeof(*lat));
+	if (lat == NULL)
+		err(1, "latencies");
+
+	base = event_init();
+	if (base == NULL)
+		err(1, "event_init");
+	if (tick != NULL && event_base_timer_wheel(base, tick) == -1)
+		err(1, "event_base_timer_wheel");
+
+	if ((*b->b_init)() == -1)
+		err(1, "%s init", b->b_name);
+
+	for (i = 0; i < iterations; i++) {
+		nevents = 0;
+		start = bench_nsec();
+		if ((*b->b_run)(&nevents) == -1)
+			err(1, "%s", b->b_name);
+		lat[i] = bench_nsec() - start;
+
+		sum += lat[i];
+		total += nevents;
+	}
+
+	(*b->b_fini)();
+	event_base_free(base);
+
+	qsort(lat, iterations, sizeof(*lat), bench_cmp);
+
+	printf("%-8s %-8s %6u %10.1f %10.1f %10.1f %10.1f %12.0f\n",
+	    BENCH_BACKEND, b->b_name, iterations,
+	    lat[iterations * 50 / 100] / 1000.0,
+	    lat[iterations * 90 / 100] / 1000.0,
+	    lat[iterations * 99 / 100] / 1000.0,
+	    lat[iterations - 1] / 1000.0,
+	    sum ? total / (sum / 1000000000.0) : 0.0);
+
+	free(lat);
+}
+
+/*
+ * pipes
+ */
+
+static void
+pipes_read(int fd, short which, void *arg)
+{
+	unsigned int idx = (uintptr_t)arg, widx = idx + 1;
+	unsigned int i;
+	char ch;
+
+	if (read(fd, &ch, sizeof(ch)) == sizeof(ch))
+		count++;
+
+	if (writes > 0) {
+		if (widx >= num)
+			widx -= num;
+		if (write(pairs[widx * 2 + 1], "e", 1) == -1)
+			err(1, "write");
+		writes--;
+		fired++;
+	}
+
+	if (writes == 0 && count == fired) {
+		for (i = 0; i < num; i++)
+			event_del(&events[i]);
+	}
+}
+
+static int
+pipes_init(void)
+{
+	if (num_active > num)
+		errx(1, "more active pipes than pipes");
+
+	bench_pairs(num);
+
+	return (0);
+}
+
+static int
+pipes_run(unsigned long long *nevents)
+{
+	unsigned int i, space;
+
+	for (i = 0; i < num; i++) {
+		event_set(&events[i], pairs[i * 2], EV_READ|EV_PERSIST,
+		    pipes_read, (void *)(uintptr_t)i);
+		if (event_add(&events[i], NULL) == -1)
+			return (-1);
+	}
+
+	count = 0;
+	writes = num_writes;
+	fired = 0;
+
+	space = num / num_active;
+	for (i = 0; i < num_active; i++, fired++) {
+		if (write(pairs[i * space * 2 + 1], "e", 1) == -1)
+			return (-1);
+	}
+
+	if (event_dispatch() == -1)
+		return (-1);
+
+	*nevents = count;
+
+	return (0);
+}
+
+static void
+pipes_fini(void)
+{
+	bench_pairs_free(num);
+}
+
+/*
+ * timers
+ */
+
+static void
+timers_fire(int nil, short which, void *arg)
+{
+	count++;
+}
+
+static int
+timers_init(void)
+{
+	unsigned int i;
+
+	events = reallocarray(NULL, num, sizeof(*events));
+	if (events == NULL)
+		return (-1);
+
+	for (i = 0; i < num; i++)
+		evtimer_set(&events[i], timers_fire, NULL);
+
+	return (0);
+}
+
+static int
+timers_run(unsigned long long *nevents)
+{
+	struct timeval tv;
+	unsigned int r, i;
+
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < num; i++) {
+			tv.tv_sec = arc4random_uniform(10);
+			tv.tv_usec = arc4random_uniform(1000000);
+			if (evtimer_add(&events[i], &tv) == -1)
+				return (-1);
+		}
+	}
+
+	timerclear(&tv);
+	for (i = 0; i < num; i++) {
+		if (evtimer_add(&events[i], &tv) == -1)
+			return (-1);
+	}
+
+	count = 0;
+	if (event_dispatch() == -1)
+		return (-1);
+	if (count != num)
+		errx(1, "%u of %u timers fired", count, num);
+
+	/* count the re-arms and the fires */
+	*nevents = (unsigned long long)num * (rounds + 1) + count;
+
+	return (0);
+}
+
+static void
+timers_fini(void)
+{
+	free(events);
+}
+
+/*
+ * signals
+ */
+
+static struct event signals_ev;
+
+static void
+signals_fire(int sig, short which, void *arg)
+{
+	if (++count < num)
+		raise(sig);
+	else
+		signal_del(&signals_ev);
+}
+
+static int
+signals_init(void)
+{
+	signal_set(&signals_ev, SIGUSR1, signals_fire, NULL);
+
+	return (0);
+}
+
+static int
+signals_run(unsigned long long *nevents)
+{
+	count = 0;
+
+	if (signal_add(&signals_ev, NULL) == -1)
+		return (-1);
+	raise(SIGUSR1);
+
+	if (event_dispatch() == -1)
+		return (-1);
+
+	*nevents = count;
+
+	return (0);
+}
+
+static void
+signals_fini(void)
+{
+	signal_del(&signals_ev);
+}
+
+/*
+ * churn
+ */
+
+static void
+churn_read(int fd, short which, void *arg)
+{
+	unsigned int i;
+	char ch;
+
+	if (read(fd, &ch, sizeof(ch)) == -1)
+		err(1, "read");
+
+	for (i = 0; i < num; i++)
+		event_del(&events[i]);
+}
+
+static int
+churn_init(void)
+{
+	unsigned int i;
+
+	bench_pairs(num);
+
+	for (i = 0; i < num; i++) {
+		event_set(&events[i], pairs[i * 2], EV_READ,
+		    churn_read, NULL);
+	}
+
+	return (0);
+}
+
+static int
+churn_run(unsigned long long *nevents)
+{
+	unsigned int r, i;
+
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < num; i++) {
+			if (event_add(&events[i], NULL) == -1)
+				return (-1);
+		}
+		for (i = 0; i < num; i++) {
+			if (event_del(&events[i]) == -1)
+				return (-1);
+		}
+	}
+
+	for (i = 0; i < num; i++) {
+		if (event_add(&events[i], NULL) == -1)
+			return (-1);
+	}
+
+	if (write(pairs[arc4random_uniform(num) * 2 + 1], "e", 1) == -1)
+		return (-1);
+
+	if (event_dispatch() == -1)
+		return (-1);
+
+	/* count the adds and dels */
+	*nevents = (unsigned long long)num * (rounds + 1) * 2;
+
+	return (0);
+}
+
+static void
+churn_fini(void)
+{
+	bench_pairs_free(num);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static struct timeval tv;
+	const struct bench *b;
+	unsigned int i;
+	int ch, all;
+
+	while ((ch = getopt(argc, argv, "a:i:n:r:t:w:")) != -1) {
+		switch (ch) {
+		case 'a':
+			num_active = bench_num(optarg, 1);
+			break;
+		case 'i':
+			iterations = bench_num(optarg, 1);
+			break;
+		case 'n':
+			num = bench_num(optarg, 1);
+			break;
+		case 'r':
+			rounds = bench_num(optarg, 0);
+			break;
+		case 't':
+			i = bench_num(optarg, 1);
+			tv.tv_sec = i / 1000000;
+			tv.tv_usec = i % 1000000;
+			tick = &tv;
+			break;
+		case 'w':
+			num_writes = bench_num(optarg, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1)
+		usage();
+
+	signal(SIGPIPE, SIG_IGN);
+
+	all = strcmp(argv[0], "all") == 0;
+
+	printf("%-8s %-8s %6s %10s %10s %10s %10s %12s\n", "backend",
+	    "bench", "iters", "p50(us)", "p90(us)", "p99(us)", "max(us)",
+	    "events/s");
+
+	for (i = 0; i < nitems(benches); i++) {
+		b = &benches[i];
+		if (all || strcmp(argv[0], b->b_name) == 0) {
+			bench_run(b);
+			if (!all)
+				return (0);
+		}
+	}
+
+	if (!all)
+		usage();
+
+	return (0);
+}
@@ -0,0 +1,352 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2017 David Gwynne <dlg@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * compare the timeout heaps.
+ *
+ * pairing	the out of line pairing heap from HEAP_GENERATE.
+ * inline	the pairing heap from HEAP_GENERATE_INLINE.
+ * dary		the array backed 4-ary heap from DHEAP_GENERATE.
+ *
+ * for each size from -n up to -m, going up by a factor of 10, the
+ * heaps get that many nodes inserted with random deadlines, a random
+ * half of them removed, and the rest taken out with cextract as the
+ * time moves forward in -s steps. the nodes are laid out in memory in
+ * a random order, like events that were allocated over time.
+ */
+
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <err.h>
+
+#include "minevent.h"
+#include "heap.h"
+#include "dheap.h"
+
+#ifndef __dead
+#define __dead __attribute__((__noreturn__))
+#endif
+
+#define BENCH_MAX	(1 << 24)
+#define BENCH_RANGE	(60ULL * 1000000000ULL)
+
+struct node {
+	union {
+		HEAP_ENTRY()		 n_heap;
+		unsigned int		 n_idx;
+	}			 n_entry;
+	struct timespec		 n_deadline;
+	char			 n_pad[64]; /* like the rest of an event */
+};
+
+static inline int
+node_deadline_cmp(const struct timespec *a, const struct timespec *b)
+{
+	if (a->tv_sec != b->tv_sec)
+		return (a->tv_sec > b->tv_sec ? 1 : -1);
+	if (a->tv_nsec != b->tv_nsec)
+		return (a->tv_nsec > b->tv_nsec ? 1 : -1);
+
+	return (0);
+}
+
+static inline int
+node_cmp(const struct node *a, const struct node *b)
+{
+	return (node_deadline_cmp(&a->n_deadline, &b->n_deadline));
+}
+
+HEAP_HEAD(pairing);
+HEAP_PROTOTYPE(pairing, node);
+HEAP_GENERATE(pairing, node, n_entry.n_heap, node_cmp);
+
+HEAP_HEAD(inlined);
+HEAP_GENERATE_INLINE(inlined, node, n_entry.n_heap, node_cmp);
+
+DHEAP_HEAD(dary, node, struct timespec);
+DHEAP_GENERATE(dary, node, n_entry.n_idx, n_deadline, node_deadline_cmp);
+
+struct result {
+	uint64_t		 r_insert;
+	uint64_t		 r_remove;
+	uint64_t		 r_cextract;
+};
+
+static unsigned int num_min = 1000;
+static unsigned int num_max = 1000000;
+static unsigned int steps = 100;
+
+static struct node **nodes;
+static struct node **order;
+
+__dead static void
+usage(void)
+{
+	extern char *__progname;
+
+	fprintf(stderr, "usage: %s [-m max] [-n min] [-s steps]\n",
+	    __progname);
+
+	exit(1);
+}
+
+static uint64_t
+bench_nsec(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		err(1, "clock_gettime");
+
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static unsigned int
+bench_num(const char *arg, unsigned int min)
+{
+	unsigned long n;
+	char *end;
+
+	/* strtonum isnt everywhere */
+	errno = 0;
+	n = strtoul(arg, &end, 10);
+	if (*arg == '\0' || *end != '\0' || errno != 0 ||
+	    n < min || n > BENCH_MAX)
+		errx(1, "%s: invalid number", arg);
+
+	return (n);
+}
+
+static uint64_t
+bench_random(void)
+{
+	static uint64_t x = 0x9e3779b97f4a7c15ULL;
+
+	/* xorshift64, so every run sees the same numbers */
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+
+	return (x);
+}
+
+static void
+bench_shuffle(struct node **a, unsigned int n)
+{
+	struct node *t;
+	unsigned int i, j;
+
+	for (i = n; i > 1; i--) {
+		j = bench_random() % i;
+		t = a[i - 1];
+		a[i - 1] = a[j];
+		a[j] = t;
+	}
+}
+
+static void
+bench_nodes(unsigned int n)
+{
+	struct node *node;
+	uint64_t nsec;
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		node = nodes[i];
+		nsec = bench_random() % BENCH_RANGE;
+		node->n_deadline.tv_sec = nsec / 1000000000ULL;
+		node->n_deadline.tv_nsec = nsec % 1000000000ULL;
+		order[i] = node;
+	}
+
+	/* remove them in a different order to the inserts */
+	bench_shuffle(order, n);
+}
+
+#define BENCH_HEAP(_name)						\
+static void								\
+_name##_bench(unsigned int n, struct result *r)				\
+{									\
+	struct _name head;						\
+	struct node key;						\
+	uint64_t start, nsec;						\
+	unsigned int i, left = n - n / 2;				\
+									\
+	HEAP_INIT(_name, &head);					\
+	bench_prepare_##_name(&head, n);				\
+									\
+	start = bench_nsec();						\
+	for (i = 0; i < n; i++)						\
+		HEAP_INSERT(_name, &head, nodes[i]);			\
+	r->r_insert = bench_nsec() - start;				\
+									\
+	start = bench_nsec();						\
+	for (i = 0; i < n / 2; i++)					\
+		HEAP_REMOVE(_name, &head, order[i]);			\
+	r->r_remove = bench_nsec() - start;				\
+									\
+	start = bench_nsec();						\
+	for (i = 1; i <= steps; i++) {					\
+		nsec = BENCH_RANGE / steps * i;				\
+		key.n_deadline.tv_sec = nsec / 1000000000ULL;		\
+		key.n_deadline.tv_nsec = nsec % 1000000000ULL;		\
+		if (i == steps)						\
+			key.n_deadline.tv_sec++;			\
+									\
+		while (HEAP_CEXTRACT(_name, &head, &key) != NULL)	\
+			left--;						\
+	}								\
+	r->r_cextract = bench_nsec() - start;				\
+									\
+	if (left != 0 || !HEAP_EMPTY(_name, &head))			\
+		errx(1, "%s: %u nodes left behind", #_name, left);	\
+									\
+	bench_finish_##_name(&head);					\
+}
+
+static void
+bench_prepare_pairing(struct pairing *head, unsigned int n)
+{
+}
+
+static void
+bench_finish_pairing(struct pairing *head)
+{
+}
+
+static void
+bench_prepare_inlined(struct inlined *head, unsigned int n)
+{
+}
+
+static void
+bench_finish_inlined(struct inlined *head)
+{
+}
+
+static void
+bench_prepare_dary(struct dary *head, unsigned int n)
+{
+	/* event_add reserves a slot at a time, which amortises to this */
+	if (DHEAP_RESERVE(dary, head, n) == -1)
+		err(1, "dary reserve");
+}
+
+static void
+bench_finish_dary(struct dary *head)
+{
+	DHEAP_DESTROY(dary, head);
+}
+
+BENCH_HEAP(pairing)
+BENCH_HEAP(inlined)
+BENCH_HEAP(dary)
+
+static const struct {
+	const char	*h_name;
+	void		(*h_bench)(unsigned int, struct result *);
+} heaps[] = {
+	{ "pairing",	pairing_bench },
+	{ "inline",	inlined_bench },
+	{ "dary",	dary_bench },
+};
+
+#define nitems(_a)	(sizeof((_a)) / sizeof((_a)[0]))
+
+static double
+bench_mops(uint64_t nsec, unsigned int n)
+{
+	if (nsec == 0)
+		nsec = 1;
+
+	return ((double)n * 1000.0 / (double)nsec);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct node *mem;
+	struct result r;
+	unsigned int n, i;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "m:n:s:")) != -1) {
+		switch (ch) {
+		case 'm':
+			num_max = bench_num(optarg, 1);
+			break;
+		case 'n':
+			num_min = bench_num(optarg, 1);
+			break;
+		case 's':
+			steps = bench_num(optarg, 1);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 0 || num_min > num_max)
+		usage();
+
+	mem = calloc(num_max, sizeof(*mem));
+	nodes = calloc(num_max, sizeof(*nodes));
+	order = calloc(num_max, sizeof(*order));
+	if (mem == NULL || nodes == NULL || order == NULL)
+		err(1, NULL);
+
+	for (i = 0; i < num_max; i++)
+		nodes[i] = &mem[i];
+	bench_shuffle(nodes, num_max);
+
+	printf("%-8s %10s %14s %14s %14s\n", "heap", "timers",
+	    "insert(M/s)", "remove(M/s)", "cextract(M/s)");
+
+	for (n = num_min; n <= num_max; n *= 10) {
+		bench_nodes(n);
+		for (i = 0; i < nitems(heaps); i++) {
+			(*heaps[i].h_bench)(n, &r);
+
+			printf("%-8s %10u %14.2f %14.2f %14.2f\n",
+			    heaps[i].h_name, n,
+			    bench_mops(r.r_insert, n),
+			    bench_mops(r.r_remove, n / 2),
+			    bench_mops(r.r_cextract, n - n / 2));
+		}
+
+		if (n > num_max / 10)
+			break;
+	}
+
+	free(order);
+	free(nodes);
+	free(mem);
+
+	return (0);
+}
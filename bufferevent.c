@@ -0,0 +1,372 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2017 David Gwynne <dlg@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * bufferevents read into an input buffer and write out of an output
+ * buffer with a pair of events on the fd. the buffers tell us when
+ * their length changes, which is where the watermarks turn the read
+ * and write events on and off.
+ */
+
+#include <sys/types.h>
+
+#include <stdlib.h>
+#include <errno.h>
+
+#include "minevent.h"
+#include "minevent-internal.h"
+#include "evbuffer.h"
+
+#define BEV_READ_SUSPENDED	(1 << 0) /* input is over the high mark */
+#define BEV_SPLICE		(1 << 1)
+
+static void	bufferevent_readcb(int, short, void *);
+static void	bufferevent_writecb(int, short, void *);
+static void	bufferevent_input_cb(struct evbuffer *, size_t, size_t,
+		    void *);
+static void	bufferevent_output_cb(struct evbuffer *, size_t, size_t,
+		    void *);
+
+static int
+bufferevent_add(struct event *ev, int timeout)
+{
+	struct timeval tv;
+
+	if (timeout == 0)
+		return (event_add(ev, NULL));
+
+	tv.tv_sec = timeout;
+	tv.tv_usec = 0;
+
+	return (event_add(ev, &tv));
+}
+
+struct bufferevent *
+bufferevent_new(int fd, evbuffercb readcb, evbuffercb writecb,
+    everrorcb errorcb, void *cbarg)
+{
+	struct bufferevent *bufev;
+
+	bufev = malloc(sizeof(*bufev));
+	if (bufev == NULL)
+		return (NULL);
+
+	bufev->input = evbuffer_new();
+	if (bufev->input == NULL)
+		goto free;
+	bufev->output = evbuffer_new();
+	if (bufev->output == NULL)
+		goto free_input;
+
+	event_set(&bufev->ev_read, fd, EV_READ|EV_PERSIST,
+	    bufferevent_readcb, bufev);
+	event_set(&bufev->ev_write, fd, EV_WRITE|EV_PERSIST,
+	    bufferevent_writecb, bufev);
+	evbuffer_setcb(bufev->input, bufferevent_input_cb, bufev);
+	evbuffer_setcb(bufev->output, bufferevent_output_cb, bufev);
+
+	bufev->wm_read.low = bufev->wm_read.high = 0;
+	bufev->wm_write.low = bufev->wm_write.high = 0;
+
+	bufev->readcb = readcb;
+	bufev->writecb = writecb;
+	bufev->errorcb = errorcb;
+	bufev->cbarg = cbarg;
+
+	bufev->timeout_read = 0;
+	bufev->timeout_write = 0;
+
+	/* writes go out as soon as there's something to write */
+	bufev->enabled = EV_WRITE;
+	bufev->flags = 0;
+
+	return (bufev);
+
+free_input:
+	evbuffer_free(bufev->input);
+free:
+	free(bufev);
+	return (NULL);
+}
+
+int
+bufferevent_base_set(struct event_base *evb, struct bufferevent *bufev)
+{
+	if (event_base_set(evb, &bufev->ev_read) == -1 ||
+	    event_base_set(evb, &bufev->ev_write) == -1)
+		return (-1);
+
+	return (0);
+}
+
+void
+bufferevent_free(struct bufferevent *bufev)
+{
+	event_del(&bufev->ev_read);
+	event_del(&bufev->ev_write);
+
+	evbuffer_free(bufev->input);
+	evbuffer_free(bufev->output);
+
+	free(bufev);
+}
+
+int
+bufferevent_enable(struct bufferevent *bufev, short event)
+{
+	if (ISSET(event, EV_READ) &&
+	    !ISSET(bufev->flags, BEV_READ_SUSPENDED) &&
+	    bufferevent_add(&bufev->ev_read, bufev->timeout_read) == -1)
+		return (-1);
+
+	if (ISSET(event, EV_WRITE) &&
+	    evbuffer_get_length(bufev->output) > 0 &&
+	    bufferevent_add(&bufev->ev_write, bufev->timeout_write) == -1)
+		return (-1);
+
+	SET(bufev->enabled, event & (EV_READ|EV_WRITE));
+
+	return (0);
+}
+
+int
+bufferevent_disable(struct bufferevent *bufev, short event)
+{
+	if (ISSET(event, EV_READ) && event_del(&bufev->ev_read) == -1)
+		return (-1);
+	if (ISSET(event, EV_WRITE) && event_del(&bufev->ev_write) == -1)
+		return (-1);
+
+	CLR(bufev->enabled, event);
+
+	return (0);
+}
+
+int
+bufferevent_write(struct bufferevent *bufev, const void *data, size_t size)
+{
+	return (evbuffer_add(bufev->output, data, size));
+}
+
+int
+bufferevent_write_buffer(struct bufferevent *bufev, struct evbuffer *buf)
+{
+	return (evbuffer_add_buffer(bufev->output, buf));
+}
+
+size_t
+bufferevent_read(struct bufferevent *bufev, void *data, size_t size)
+{
+	int rv;
+
+	rv = evbuffer_remove(bufev->input, data, size);
+	if (rv == -1)
+		return (0);
+
+	return (rv);
+}
+
+void
+bufferevent_setwatermark(struct bufferevent *bufev, short events,
+    size_t low, size_t high)
+{
+	size_t len = evbuffer_get_length(bufev->input);
+
+	if (ISSET(events, EV_READ)) {
+		bufev->wm_read.low = low;
+		bufev->wm_read.high = high;
+
+		/* the new marks may let reads start or stop */
+		if (high != 0 && len >= high) {
+			event_del(&bufev->ev_read);
+			SET(bufev->flags, BEV_READ_SUSPENDED);
+		} else
+			bufferevent_input_cb(bufev->input, len, len, bufev);
+	}
+
+	if (ISSET(events, EV_WRITE)) {
+		bufev->wm_write.low = low;
+		bufev->wm_write.high = high;
+	}
+}
+
+void
+bufferevent_settimeout(struct bufferevent *bufev,
+    int timeout_read, int timeout_write)
+{
+	bufev->timeout_read = timeout_read;
+	bufev->timeout_write = timeout_write;
+
+	if (event_pending(&bufev->ev_read, EV_READ, NULL))
+		bufferevent_add(&bufev->ev_read, timeout_read);
+	if (event_pending(&bufev->ev_write, EV_WRITE, NULL))
+		bufferevent_add(&bufev->ev_write, timeout_write);
+}
+
+int
+bufferevent_splice(struct bufferevent *bufev, int on)
+{
+#if defined(EVENT_HAS_SPLICE)
+	if (on)
+		SET(bufev->flags, BEV_SPLICE);
+	else
+		CLR(bufev->flags, BEV_SPLICE);
+
+	return (0);
+#else
+	errno = EOPNOTSUPP;
+	return (-1);
+#endif
+}
+
+static void
+bufferevent_input_cb(struct evbuffer *buf, size_t olen, size_t nlen,
+    void *arg)
+{
+	struct bufferevent *bufev = arg;
+
+	if (!ISSET(bufev->flags, BEV_READ_SUSPENDED))
+		return;
+	if (bufev->wm_read.high != 0 && nlen >= bufev->wm_read.high)
+		return;
+
+	/* the reader has caught up */
+	CLR(bufev->flags, BEV_READ_SUSPENDED);
+	if (ISSET(bufev->enabled, EV_READ))
+		bufferevent_add(&bufev->ev_read, bufev->timeout_read);
+}
+
+static void
+bufferevent_output_cb(struct evbuffer *buf, size_t olen, size_t nlen,
+    void *arg)
+{
+	struct bufferevent *bufev = arg;
+
+	if (nlen == 0)
+		event_del(&bufev->ev_write);
+	else if (ISSET(bufev->enabled, EV_WRITE) &&
+	    !event_pending(&bufev->ev_write, EV_WRITE, NULL))
+		bufferevent_add(&bufev->ev_write, bufev->timeout_write);
+}
+
+static void
+bufferevent_readcb(int fd, short event, void *arg)
+{
+	struct bufferevent *bufev = arg;
+	short what = EVBUFFER_READ;
+	size_t len = evbuffer_get_length(bufev->input);
+	int howmuch = -1;
+	int n;
+
+	if (event == EV_TIMEOUT) {
+		SET(what, EVBUFFER_TIMEOUT);
+		goto error;
+	}
+
+	if (bufev->wm_read.high != 0) {
+		if (len >= bufev->wm_read.high) {
+			event_del(&bufev->ev_read);
+			SET(bufev->flags, BEV_READ_SUSPENDED);
+			return;
+		}
+		howmuch = bufev->wm_read.high - len;
+	}
+
+	if (ISSET(bufev->flags, BEV_SPLICE))
+		n = evbuffer_read_splice(bufev->input, fd, howmuch);
+	else
+		n = evbuffer_read(bufev->input, fd, howmuch);
+
+	switch (n) {
+	case -1:
+		if (errno == EAGAIN || errno == EINTR)
+			goto reschedule;
+		SET(what, EVBUFFER_ERROR);
+		goto error;
+	case 0:
+		SET(what, EVBUFFER_EOF);
+		goto error;
+	}
+
+	len = evbuffer_get_length(bufev->input);
+	if (bufev->wm_read.high != 0 && len >= bufev->wm_read.high) {
+		event_del(&bufev->ev_read);
+		SET(bufev->flags, BEV_READ_SUSPENDED);
+	} else if (bufev->timeout_read != 0)
+		bufferevent_add(&bufev->ev_read, bufev->timeout_read);
+
+	if (len < bufev->wm_read.low || bufev->readcb == NULL)
+		return;
+
+	(*bufev->readcb)(bufev, bufev->cbarg);
+	return;
+
+reschedule:
+	bufferevent_add(&bufev->ev_read, bufev->timeout_read);
+	return;
+
+error:
+	event_del(&bufev->ev_read);
+	CLR(bufev->enabled, EV_READ);
+	if (bufev->errorcb != NULL)
+		(*bufev->errorcb)(bufev, what, bufev->cbarg);
+}
+
+static void
+bufferevent_writecb(int fd, short event, void *arg)
+{
+	struct bufferevent *bufev = arg;
+	short what = EVBUFFER_WRITE;
+	int n;
+
+	if (event == EV_TIMEOUT) {
+		SET(what, EVBUFFER_TIMEOUT);
+		goto error;
+	}
+
+	if (evbuffer_get_length(bufev->output) > 0) {
+		n = evbuffer_write(bufev->output, fd);
+		switch (n) {
+		case -1:
+			if (errno == EAGAIN || errno == EINTR ||
+			    errno == ENOBUFS)
+				break;
+			SET(what, EVBUFFER_ERROR);
+			goto error;
+		case 0:
+			SET(what, EVBUFFER_EOF);
+			goto error;
+		}
+	}
+
+	/* the output callback takes the event away once it's empty */
+	if (evbuffer_get_length(bufev->output) > 0 &&
+	    bufev->timeout_write != 0)
+		bufferevent_add(&bufev->ev_write, bufev->timeout_write);
+
+	if (bufev->writecb != NULL &&
+	    evbuffer_get_length(bufev->output) <= bufev->wm_write.low)
+		(*bufev->writecb)(bufev, bufev->cbarg);
+	return;
+
+error:
+	event_del(&bufev->ev_write);
+	CLR(bufev->enabled, EV_WRITE);
+	if (bufev->errorcb != NULL)
+		(*bufev->errorcb)(bufev, what, bufev->cbarg);
+}
@@ -0,0 +1,233 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2017 David Gwynne <dlg@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _LIB_EVENT_DHEAP_H_
+#define _LIB_EVENT_DHEAP_H_
+
+/*
+ * an array backed 4-ary min heap.
+ *
+ * a copy of each key is kept in the array next to a pointer to its
+ * node, so comparisons while sifting only touch the array. each node
+ * keeps the index of its slot so it can be removed in O(log n). the
+ * key of a node must not change while it is in the heap.
+ *
+ * DHEAP_GENERATE provides the same _name##_HEAP_* functions as the
+ * pairing heap in heap.h, so the HEAP_* macros work with both. the
+ * array has to have room before HEAP_INSERT is called, which is what
+ * DHEAP_RESERVE is for.
+ */
+
+#define DHEAP_ARITY		4
+#define DHEAP_MINSLOTS		64
+
+#define DHEAP_HEAD(_name, _type, _ktype)				\
+struct _name##_slot {							\
+	_ktype			 key;					\
+	struct _type		*node;					\
+};									\
+struct _name {								\
+	struct _name##_slot	*slots;					\
+	unsigned int		 nslots;				\
+	unsigned int		 len;					\
+}
+
+#define DHEAP_GENERATE(_name, _type, _idx, _key, _cmp)			\
+static inline void							\
+_name##_HEAP_SET(struct _name *head, unsigned int i,			\
+    const struct _name##_slot *s)					\
+{									\
+	head->slots[i] = *s;						\
+	s->node->_idx = i;						\
+}									\
+									\
+static inline void							\
+_name##_HEAP_UP(struct _name *head, unsigned int i)			\
+{									\
+	struct _name##_slot s = head->slots[i];				\
+	unsigned int p;							\
+									\
+	while (i > 0) {							\
+		p = (i - 1) / DHEAP_ARITY;				\
+		if (_cmp(&head->slots[p].key, &s.key) <= 0)		\
+			break;						\
+									\
+		_name##_HEAP_SET(head, i, &head->slots[p]);		\
+		i = p;							\
+	}								\
+									\
+	_name##_HEAP_SET(head, i, &s);					\
+}									\
+									\
+static inline void							\
+_name##_HEAP_DOWN(struct _name *head, unsigned int i)			\
+{									\
+	struct _name##_slot s = head->slots[i];				\
+	unsigned int n = head->nslots;					\
+	unsigned int c, m, end;						\
+									\
+	for (;;) {							\
+		c = i * DHEAP_ARITY + 1;				\
+		if (c >= n)						\
+			break;						\
+									\
+		end = c + DHEAP_ARITY;					\
+		if (end > n)						\
+			end = n;					\
+									\
+		/* find the smallest child */				\
+		for (m = c++; c < end; c++) {				\
+			if (_cmp(&head->slots[c].key,			\
+			    &head->slots[m].key) < 0)			\
+				m = c;					\
+		}							\
+									\
+		if (_cmp(&head->slots[m].key, &s.key) >= 0)		\
+			break;						\
+									\
+		_name##_HEAP_SET(head, i, &head->slots[m]);		\
+		i = m;							\
+	}								\
+									\
+	_name##_HEAP_SET(head, i, &s);					\
+}									\
+									\
+static inline void							\
+_name##_HEAP_INIT(struct _name *head)					\
+{									\
+	head->slots = NULL;						\
+	head->nslots = 0;						\
+	head->len = 0;							\
+}									\
+									\
+static inline void							\
+_name##_HEAP_DESTROY(struct _name *head)				\
+{									\
+	free(head->slots);						\
+}									\
+									\
+static inline int							\
+_name##_HEAP_RESERVE(struct _name *head, unsigned int n)		\
+{									\
+	struct _name##_slot *slots;					\
+	unsigned int len = head->len;					\
+									\
+	if (head->nslots + n <= len)					\
+		return (0);						\
+									\
+	if (len == 0)							\
+		len = DHEAP_MINSLOTS;					\
+	while (len < head->nslots + n)					\
+		len *= 2;						\
+									\
+	slots = reallocarray(head->slots, len, sizeof(*slots));		\
+	if (slots == NULL)						\
+		return (-1);						\
+									\
+	head->slots = slots;						\
+	head->len = len;						\
+									\
+	return (0);							\
+}									\
+									\
+static inline void							\
+_name##_HEAP_INSERT(struct _name *head, struct _type *elm)		\
+{									\
+	struct _name##_slot *s = &head->slots[head->nslots];		\
+									\
+	s->key = elm->_key;						\
+	s->node = elm;							\
+	_name##_HEAP_UP(head, head->nslots++);				\
+}									\
+									\
+static inline void							\
+_name##_HEAP_REMOVE(struct _name *head, struct _type *elm)		\
+{									\
+	unsigned int i = elm->_idx;					\
+	unsigned int last = --head->nslots;				\
+									\
+	if (i == last)							\
+		return;							\
+									\
+	/* move the last slot into the hole and put it in its place */	\
+	_name##_HEAP_SET(head, i, &head->slots[last]);			\
+	if (i > 0 && _cmp(&head->slots[i].key,				\
+	    &head->slots[(i - 1) / DHEAP_ARITY].key) < 0)		\
+		_name##_HEAP_UP(head, i);				\
+	else								\
+		_name##_HEAP_DOWN(head, i);				\
+}									\
+									\
+static inline struct _type *						\
+_name##_HEAP_FIRST(struct _name *head)					\
+{									\
+	if (head->nslots == 0)						\
+		return (NULL);						\
+									\
+	return (head->slots[0].node);					\
+}									\
+									\
+static inline struct _type *						\
+_name##_HEAP_EXTRACT(struct _name *head)				\
+{									\
+	struct _type *elm;						\
+									\
+	if (head->nslots == 0)						\
+		return (NULL);						\
+									\
+	elm = head->slots[0].node;					\
+	_name##_HEAP_REMOVE(head, elm);					\
+									\
+	return (elm);							\
+}									\
+									\
+static inline struct _type *						\
+_name##_HEAP_CEXTRACT(struct _name *head, const struct _type *key)	\
+{									\
+	struct _type *elm;						\
+									\
+	if (head->nslots == 0 ||					\
+	    _cmp(&head->slots[0].key, &key->_key) > 0)			\
+		return (NULL);						\
+									\
+	elm = head->slots[0].node;					\
+	_name##_HEAP_REMOVE(head, elm);					\
+									\
+	return (elm);							\
+}									\
+									\
+static inline void							\
+_name##_HEAP_EXTRACT_LE(struct _name *head, const struct _type *key,	\
+    void (*fn)(void *, void *), void *arg)				\
+{									\
+	struct _type *elm;						\
+									\
+	while ((elm = _name##_HEAP_CEXTRACT(head, key)) != NULL)	\
+		(*fn)(elm, arg);					\
+}									\
+									\
+static inline int							\
+_name##_HEAP_EMPTY(struct _name *head)					\
+{									\
+	return (head->nslots == 0);					\
+}
+
+#define DHEAP_DESTROY(_name, _h)	_name##_HEAP_DESTROY((_h))
+#define DHEAP_RESERVE(_name, _h, _n)	_name##_HEAP_RESERVE((_h), (_n))
+
+#endif /* _LIB_EVENT_DHEAP_H_ */
@@ -0,0 +1,853 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2017 David Gwynne <dlg@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * an evbuffer is a list of chains, each of which looks at part of a
+ * block. blocks are reference counted so the same data can sit in
+ * several buffers without being copied, but a block is only written
+ * to while one chain refers to it.
+ *
+ * a block usually holds the data itself, but it may also point at the
+ * caller's memory, at a range of a file, or at a pipe the data was
+ * spliced into. files and pipes are written out with sendfile and
+ * splice, and only read into memory if something wants the bytes.
+ */
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "minevent.h"
+#include "minevent-internal.h"
+#include "evbuffer.h"
+
+#if defined(EVENT_HAS_SENDFILE)
+#include <sys/sendfile.h>
+#endif
+
+#define EVBUFFER_BLOCKSIZE	4096
+#define EVBUFFER_MAX_READ	65536
+#define EVBUFFER_PIPESIZE	65536	/* what linux pipes hold by default */
+#define EVBUFFER_IOVS		64
+
+#define EVBUFFER_BLK_MEM	0	/* the data follows the block */
+#define EVBUFFER_BLK_REF	1	/* the data belongs to the caller */
+#define EVBUFFER_BLK_FILE	2	/* the data is still in a file */
+#define EVBUFFER_BLK_PIPE	3	/* the data is in a pipe */
+
+struct evbuffer_block {
+	unsigned int		  eb_refs;
+	int			  eb_type;
+	const unsigned char	 *eb_data;
+	size_t			  eb_size;
+
+	off_t			  eb_off; /* where the file data starts */
+	int			  eb_fds[2];
+
+	void			(*eb_cleanup)(const void *, size_t, void *);
+	void			 *eb_arg;
+};
+
+struct evbuffer_chain {
+	TAILQ_ENTRY(evbuffer_chain) ch_entry;
+	struct evbuffer_block	 *ch_blk;
+	size_t			  ch_off;
+	size_t			  ch_len;
+};
+
+TAILQ_HEAD(evbuffer_chains, evbuffer_chain);
+
+struct evbuffer {
+	struct evbuffer_chains	  buf_chains;
+	size_t			  buf_len;
+	struct evbuffer_block	 *buf_spare; /* what the last read didn't use */
+
+	void			(*buf_cb)(struct evbuffer *, size_t, size_t,
+				      void *);
+	void			 *buf_cbarg;
+};
+
+static struct evbuffer_block *
+evbuffer_block_new(int type, size_t size)
+{
+	struct evbuffer_block *eb;
+	size_t len = sizeof(*eb);
+
+	if (type == EVBUFFER_BLK_MEM)
+		len += size;
+
+	eb = malloc(len);
+	if (eb == NULL)
+		return (NULL);
+
+	eb->eb_refs = 1;
+	eb->eb_type = type;
+	eb->eb_data = (type == EVBUFFER_BLK_MEM) ?
+	    (const unsigned char *)(eb + 1) : NULL;
+	eb->eb_size = size;
+	eb->eb_off = 0;
+	eb->eb_fds[0] = eb->eb_fds[1] = -1;
+	eb->eb_cleanup = NULL;
+	eb->eb_arg = NULL;
+
+	return (eb);
+}
+
+static inline unsigned char *
+evbuffer_block_mem(struct evbuffer_block *eb)
+{
+	return ((unsigned char *)(eb + 1));
+}
+
+static void
+evbuffer_block_rele(struct evbuffer_block *eb)
+{
+	/* buffers may be shared between loops on different threads */
+	if (__atomic_sub_fetch(&eb->eb_refs, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+
+	switch (eb->eb_type) {
+	case EVBUFFER_BLK_REF:
+		if (eb->eb_cleanup != NULL)
+			(*eb->eb_cleanup)(eb->eb_data, eb->eb_size,
+			    eb->eb_arg);
+		break;
+	case EVBUFFER_BLK_FILE:
+		close(eb->eb_fds[0]);
+		break;
+	case EVBUFFER_BLK_PIPE:
+		close(eb->eb_fds[0]);
+		close(eb->eb_fds[1]);
+		break;
+	}
+
+	free(eb);
+}
+
+static struct evbuffer_chain *
+evbuffer_chain_new(struct evbuffer_block *eb, size_t off, size_t len)
+{
+	struct evbuffer_chain *ch;
+
+	ch = malloc(sizeof(*ch));
+	if (ch == NULL)
+		return (NULL);
+
+	ch->ch_blk = eb;
+	ch->ch_off = off;
+	ch->ch_len = len;
+
+	return (ch);
+}
+
+static void
+evbuffer_chain_free(struct evbuffer_chain *ch)
+{
+	evbuffer_block_rele(ch->ch_blk);
+	free(ch);
+}
+
+/* how much more can be written onto the end of this chain */
+static size_t
+evbuffer_chain_space(const struct evbuffer_chain *ch)
+{
+	const struct evbuffer_block *eb = ch->ch_blk;
+
+	if (eb->eb_type != EVBUFFER_BLK_MEM ||
+	    __atomic_load_n(&eb->eb_refs, __ATOMIC_ACQUIRE) != 1)
+		return (0);
+
+	return (eb->eb_size - (ch->ch_off + ch->ch_len));
+}
+
+/*
+ * read a file or pipe chain into memory.
+ */
+static int
+evbuffer_chain_load(struct evbuffer_chain *ch)
+{
+	struct evbuffer_block *ob = ch->ch_blk, *eb;
+	unsigned char *mem;
+	size_t len = 0;
+	ssize_t n;
+
+	if (ob->eb_type == EVBUFFER_BLK_MEM ||
+	    ob->eb_type == EVBUFFER_BLK_REF)
+		return (0);
+
+	eb = evbuffer_block_new(EVBUFFER_BLK_MEM, ch->ch_len);
+	if (eb == NULL)
+		return (-1);
+
+	mem = evbuffer_block_mem(eb);
+	while (len < ch->ch_len) {
+		if (ob->eb_type == EVBUFFER_BLK_FILE) {
+			n = pread(ob->eb_fds[0], mem + len, ch->ch_len - len,
+			    ob->eb_off + ch->ch_off + len);
+		} else {
+			/* the bytes are known to be in the pipe already */
+			n = read(ob->eb_fds[0], mem + len, ch->ch_len - len);
+		}
+
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			if (n == 0)
+				errno = EIO;
+			free(eb);
+			return (-1);
+		}
+
+		len += n;
+	}
+
+	evbuffer_block_rele(ob);
+	ch->ch_blk = eb;
+	ch->ch_off = 0;
+
+	return (0);
+}
+
+/* make sure the first len bytes are in memory */
+static int
+evbuffer_load(struct evbuffer *buf, size_t len)
+{
+	struct evbuffer_chain *ch;
+
+	TAILQ_FOREACH(ch, &buf->buf_chains, ch_entry) {
+		if (len == 0)
+			break;
+
+		if (evbuffer_chain_load(ch) == -1)
+			return (-1);
+
+		len -= (len < ch->ch_len) ? len : ch->ch_len;
+	}
+
+	return (0);
+}
+
+/* drop bytes off the front of the buffer, whatever they're in */
+static void
+evbuffer_trim(struct evbuffer *buf, size_t len)
+{
+	struct evbuffer_chain *ch;
+
+	while (len > 0 && (ch = TAILQ_FIRST(&buf->buf_chains)) != NULL) {
+		if (len < ch->ch_len) {
+			ch->ch_off += len;
+			ch->ch_len -= len;
+			buf->buf_len -= len;
+			break;
+		}
+
+		len -= ch->ch_len;
+		buf->buf_len -= ch->ch_len;
+		TAILQ_REMOVE(&buf->buf_chains, ch, ch_entry);
+		evbuffer_chain_free(ch);
+	}
+}
+
+static void
+evbuffer_changed(struct evbuffer *buf, size_t olen)
+{
+	if (buf->buf_cb != NULL && buf->buf_len != olen)
+		(*buf->buf_cb)(buf, olen, buf->buf_len, buf->buf_cbarg);
+}
+
+struct evbuffer *
+evbuffer_new(void)
+{
+	struct evbuffer *buf;
+
+	buf = malloc(sizeof(*buf));
+	if (buf == NULL)
+		return (NULL);
+
+	TAILQ_INIT(&buf->buf_chains);
+	buf->buf_len = 0;
+	buf->buf_spare = NULL;
+	buf->buf_cb = NULL;
+	buf->buf_cbarg = NULL;
+
+	return (buf);
+}
+
+void
+evbuffer_free(struct evbuffer *buf)
+{
+	struct evbuffer_chain *ch;
+
+	while ((ch = TAILQ_FIRST(&buf->buf_chains)) != NULL) {
+		TAILQ_REMOVE(&buf->buf_chains, ch, ch_entry);
+		evbuffer_chain_free(ch);
+	}
+
+	if (buf->buf_spare != NULL)
+		evbuffer_block_rele(buf->buf_spare);
+	free(buf);
+}
+
+size_t
+evbuffer_get_length(const struct evbuffer *buf)
+{
+	return (buf->buf_len);
+}
+
+void
+evbuffer_setcb(struct evbuffer *buf,
+    void (*cb)(struct evbuffer *, size_t, size_t, void *), void *arg)
+{
+	buf->buf_cb = cb;
+	buf->buf_cbarg = arg;
+}
+
+int
+evbuffer_add(struct evbuffer *buf, const void *data, size_t len)
+{
+	struct evbuffer_chain *last, *ch = NULL;
+	struct evbuffer_block *eb;
+	size_t space = 0, olen = buf->buf_len;
+
+	last = TAILQ_LAST(&buf->buf_chains, evbuffer_chains);
+	if (last != NULL)
+		space = evbuffer_chain_space(last);
+	if (space > len)
+		space = len;
+
+	/* get the memory before touching anything */
+	if (len > space) {
+		eb = evbuffer_block_new(EVBUFFER_BLK_MEM,
+		    len - space > EVBUFFER_BLOCKSIZE ?
+		    len - space : EVBUFFER_BLOCKSIZE);
+		if (eb == NULL)
+			return (-1);
+
+		ch = evbuffer_chain_new(eb, 0, len - space);
+		if (ch == NULL) {
+			evbuffer_block_rele(eb);
+			return (-1);
+		}
+
+		memcpy(evbuffer_block_mem(eb),
+		    (const unsigned char *)data + space, len - space);
+	}
+
+	if (space > 0) {
+		memcpy(evbuffer_block_mem(last->ch_blk) + last->ch_off +
+		    last->ch_len, data, space);
+		last->ch_len += space;
+	}
+
+	if (ch != NULL)
+		TAILQ_INSERT_TAIL(&buf->buf_chains, ch, ch_entry);
+
+	buf->buf_len += len;
+	evbuffer_changed(buf, olen);
+
+	return (0);
+}
+
+int
+evbuffer_add_reference(struct evbuffer *buf, const void *data, size_t len,
+    void (*cleanup)(const void *, size_t, void *), void *arg)
+{
+	struct evbuffer_chain *ch;
+	struct evbuffer_block *eb;
+	size_t olen = buf->buf_len;
+
+	eb = evbuffer_block_new(EVBUFFER_BLK_REF, len);
+	if (eb == NULL)
+		return (-1);
+
+	eb->eb_data = data;
+	eb->eb_cleanup = cleanup;
+	eb->eb_arg = arg;
+
+	ch = evbuffer_chain_new(eb, 0, len);
+	if (ch == NULL) {
+		free(eb);
+		return (-1);
+	}
+
+	TAILQ_INSERT_TAIL(&buf->buf_chains, ch, ch_entry);
+	buf->buf_len += len;
+	evbuffer_changed(buf, olen);
+
+	return (0);
+}
+
+int
+evbuffer_add_buffer(struct evbuffer *dst, struct evbuffer *src)
+{
+	struct evbuffer_chain *ch;
+	size_t dlen = dst->buf_len, slen = src->buf_len;
+
+	if (dst == src) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	/* the chains move over, the data stays where it is */
+	while ((ch = TAILQ_FIRST(&src->buf_chains)) != NULL) {
+		TAILQ_REMOVE(&src->buf_chains, ch, ch_entry);
+		TAILQ_INSERT_TAIL(&dst->buf_chains, ch, ch_entry);
+	}
+
+	dst->buf_len += slen;
+	src->buf_len = 0;
+
+	evbuffer_changed(src, slen);
+	evbuffer_changed(dst, dlen);
+
+	return (0);
+}
+
+int
+evbuffer_add_buffer_reference(struct evbuffer *dst, struct evbuffer *src)
+{
+	struct evbuffer_chains chains = TAILQ_HEAD_INITIALIZER(chains);
+	struct evbuffer_chain *sch, *ch;
+	size_t olen = dst->buf_len;
+
+	if (dst == src) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	TAILQ_FOREACH(sch, &src->buf_chains, ch_entry) {
+		/* reading from a pipe takes the bytes away from it */
+		if (sch->ch_blk->eb_type == EVBUFFER_BLK_PIPE &&
+		    evbuffer_chain_load(sch) == -1)
+			goto fail;
+
+		ch = evbuffer_chain_new(sch->ch_blk, sch->ch_off,
+		    sch->ch_len);
+		if (ch == NULL)
+			goto fail;
+
+		__atomic_add_fetch(&sch->ch_blk->eb_refs, 1, __ATOMIC_RELAXED);
+		TAILQ_INSERT_TAIL(&chains, ch, ch_entry);
+	}
+
+	while ((ch = TAILQ_FIRST(&chains)) != NULL) {
+		TAILQ_REMOVE(&chains, ch, ch_entry);
+		TAILQ_INSERT_TAIL(&dst->buf_chains, ch, ch_entry);
+	}
+
+	dst->buf_len += src->buf_len;
+	evbuffer_changed(dst, olen);
+
+	return (0);
+
+fail:
+	while ((ch = TAILQ_FIRST(&chains)) != NULL) {
+		TAILQ_REMOVE(&chains, ch, ch_entry);
+		evbuffer_chain_free(ch);
+	}
+
+	return (-1);
+}
+
+int
+evbuffer_add_file(struct evbuffer *buf, int fd, off_t off, off_t len)
+{
+	struct evbuffer_chain *ch;
+	struct evbuffer_block *eb;
+	size_t olen = buf->buf_len;
+
+	if (off < 0 || len < 0 || (uintmax_t)len > SIZE_MAX) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	if (len == 0) {
+		/* the buffer owns the fd, but there's nothing to send */
+		close(fd);
+		return (0);
+	}
+
+	eb = evbuffer_block_new(EVBUFFER_BLK_FILE, len);
+	if (eb == NULL)
+		return (-1);
+
+	eb->eb_off = off;
+	eb->eb_fds[0] = fd;
+
+	ch = evbuffer_chain_new(eb, 0, len);
+	if (ch == NULL) {
+		free(eb);
+		return (-1);
+	}
+
+#if !defined(EVENT_HAS_SENDFILE)
+	/* there's no sendfile to write it with, so read it in now */
+	if (evbuffer_chain_load(ch) == -1) {
+		free(ch);
+		free(eb);
+		return (-1);
+	}
+#endif
+
+	/* the buffer owns the fd now */
+	TAILQ_INSERT_TAIL(&buf->buf_chains, ch, ch_entry);
+	buf->buf_len += len;
+	evbuffer_changed(buf, olen);
+
+	return (0);
+}
+
+int
+evbuffer_drain(struct evbuffer *buf, size_t len)
+{
+	struct evbuffer_chain *ch;
+	size_t olen = buf->buf_len, skip = len;
+	int rv = 0;
+
+	/* the data in a pipe has to be read out to drop part of it */
+	TAILQ_FOREACH(ch, &buf->buf_chains, ch_entry) {
+		if (skip < ch->ch_len) {
+			if (skip > 0 &&
+			    ch->ch_blk->eb_type == EVBUFFER_BLK_PIPE &&
+			    evbuffer_chain_load(ch) == -1)
+				rv = -1;
+			break;
+		}
+		skip -= ch->ch_len;
+	}
+
+	if (rv == 0)
+		evbuffer_trim(buf, len);
+
+	evbuffer_changed(buf, olen);
+
+	return (rv);
+}
+
+int
+evbuffer_remove(struct evbuffer *buf, void *data, size_t len)
+{
+	struct evbuffer_chain *ch;
+	unsigned char *p = data;
+	size_t n, copied = 0;
+
+	if (len > buf->buf_len)
+		len = buf->buf_len;
+	if (evbuffer_load(buf, len) == -1)
+		return (-1);
+
+	TAILQ_FOREACH(ch, &buf->buf_chains, ch_entry) {
+		if (copied == len)
+			break;
+
+		n = len - copied;
+		if (n > ch->ch_len)
+			n = ch->ch_len;
+
+		memcpy(p + copied, ch->ch_blk->eb_data + ch->ch_off, n);
+		copied += n;
+	}
+
+	evbuffer_drain(buf, len);
+
+	return (len);
+}
+
+unsigned char *
+evbuffer_pullup(struct evbuffer *buf, ssize_t size)
+{
+	struct evbuffer_chain *ch, *nch;
+	struct evbuffer_block *eb;
+	size_t n, len;
+
+	if (size < 0)
+		len = buf->buf_len;
+	else if ((size_t)size > buf->buf_len)
+		return (NULL);
+	else
+		len = size;
+
+	ch = TAILQ_FIRST(&buf->buf_chains);
+	if (ch == NULL)
+		return (NULL);
+	if (evbuffer_load(buf, len) == -1)
+		return (NULL);
+
+	/* the caller may write to it, so shared blocks are copied too */
+	if (ch->ch_len >= len && ch->ch_blk->eb_type == EVBUFFER_BLK_MEM &&
+	    __atomic_load_n(&ch->ch_blk->eb_refs, __ATOMIC_ACQUIRE) == 1)
+		return (evbuffer_block_mem(ch->ch_blk) + ch->ch_off);
+
+	eb = evbuffer_block_new(EVBUFFER_BLK_MEM, len);
+	if (eb == NULL)
+		return (NULL);
+
+	nch = evbuffer_chain_new(eb, 0, len);
+	if (nch == NULL) {
+		free(eb);
+		return (NULL);
+	}
+
+	for (n = 0; n < len;) {
+		ch = TAILQ_FIRST(&buf->buf_chains);
+		if (ch->ch_len > len - n) {
+			memcpy(evbuffer_block_mem(eb) + n,
+			    ch->ch_blk->eb_data + ch->ch_off, len - n);
+			ch->ch_off += len - n;
+			ch->ch_len -= len - n;
+			break;
+		}
+
+		memcpy(evbuffer_block_mem(eb) + n,
+		    ch->ch_blk->eb_data + ch->ch_off, ch->ch_len);
+		n += ch->ch_len;
+		TAILQ_REMOVE(&buf->buf_chains, ch, ch_entry);
+		evbuffer_chain_free(ch);
+	}
+
+	TAILQ_INSERT_HEAD(&buf->buf_chains, nch, ch_entry);
+
+	return (evbuffer_block_mem(eb));
+}
+
+/*
+ * io
+ */
+
+int
+evbuffer_read(struct evbuffer *buf, int fd, int howmuch)
+{
+	struct evbuffer_chain *last, *ch;
+	struct evbuffer_block *eb = NULL;
+	struct iovec iov[2];
+	size_t space = 0, need, olen = buf->buf_len;
+	int niov = 0, avail;
+	ssize_t n;
+
+	if (howmuch < 0 || howmuch > EVBUFFER_MAX_READ) {
+		/* ask how much is there so the buffer doesn't overgrow */
+		if (ioctl(fd, FIONREAD, &avail) == -1 || avail <= 0)
+			avail = EVBUFFER_BLOCKSIZE;
+		if (howmuch < 0 || howmuch > avail)
+			howmuch = avail;
+		if (howmuch > EVBUFFER_MAX_READ)
+			howmuch = EVBUFFER_MAX_READ;
+	}
+
+	/* fill the space at the end of the buffer first */
+	last = TAILQ_LAST(&buf->buf_chains, evbuffer_chains);
+	if (last != NULL)
+		space = evbuffer_chain_space(last);
+	if (space > (size_t)howmuch)
+		space = howmuch;
+	if (space > 0) {
+		iov[niov].iov_base = evbuffer_block_mem(last->ch_blk) +
+		    last->ch_off + last->ch_len;
+		iov[niov].iov_len = space;
+		niov++;
+	}
+
+	need = howmuch - space;
+	if (need > 0) {
+		eb = buf->buf_spare;
+		buf->buf_spare = NULL;
+		if (eb != NULL && eb->eb_size < need) {
+			evbuffer_block_rele(eb);
+			eb = NULL;
+		}
+		if (eb == NULL) {
+			eb = evbuffer_block_new(EVBUFFER_BLK_MEM,
+			    (need + EVBUFFER_BLOCKSIZE - 1) &
+			    ~(size_t)(EVBUFFER_BLOCKSIZE - 1));
+			if (eb == NULL)
+				return (-1);
+		}
+
+		iov[niov].iov_base = evbuffer_block_mem(eb);
+		iov[niov].iov_len = need;
+		niov++;
+	}
+
+	n = readv(fd, iov, niov);
+	if (n <= 0 || (size_t)n <= space) {
+		/*
+		 * keep the block around for next time. the spare was
+		 * only taken if a block was needed, so leave it alone
+		 * if there's nothing to put back.
+		 */
+		if (eb != NULL)
+			buf->buf_spare = eb;
+		if (n > 0)
+			goto fill;
+		return (n);
+	}
+
+	ch = evbuffer_chain_new(eb, 0, n - space);
+	if (ch == NULL) {
+		/* the data is lost, which is as bad as a read error */
+		evbuffer_block_rele(eb);
+		return (-1);
+	}
+	TAILQ_INSERT_TAIL(&buf->buf_chains, ch, ch_entry);
+
+fill:
+	if (space > 0)
+		last->ch_len += ((size_t)n < space) ? (size_t)n : space;
+
+	buf->buf_len += n;
+	evbuffer_changed(buf, olen);
+
+	return (n);
+}
+
+int
+evbuffer_read_splice(struct evbuffer *buf, int fd, int howmuch)
+{
+#if defined(EVENT_HAS_SPLICE)
+	struct evbuffer_chain *ch;
+	struct evbuffer_block *eb = NULL;
+	size_t olen = buf->buf_len;
+	ssize_t n;
+
+	if (howmuch < 0 || howmuch > EVBUFFER_PIPESIZE)
+		howmuch = EVBUFFER_PIPESIZE;
+
+	/* keep adding to the last pipe until it's full */
+	ch = TAILQ_LAST(&buf->buf_chains, evbuffer_chains);
+	if (ch != NULL && ch->ch_blk->eb_type == EVBUFFER_BLK_PIPE &&
+	    ch->ch_len < EVBUFFER_PIPESIZE) {
+		if ((size_t)howmuch > EVBUFFER_PIPESIZE - ch->ch_len)
+			howmuch = EVBUFFER_PIPESIZE - ch->ch_len;
+	} else {
+		eb = evbuffer_block_new(EVBUFFER_BLK_PIPE, EVBUFFER_PIPESIZE);
+		if (eb == NULL)
+			return (-1);
+		if (pipe2(eb->eb_fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+			free(eb);
+			return (-1);
+		}
+
+		ch = evbuffer_chain_new(eb, 0, 0);
+		if (ch == NULL) {
+			evbuffer_block_rele(eb);
+			return (-1);
+		}
+	}
+
+	n = splice(fd, NULL, ch->ch_blk->eb_fds[1], NULL, howmuch,
+	    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (n <= 0) {
+		if (eb != NULL)
+			evbuffer_chain_free(ch);
+		return (n);
+	}
+
+	if (eb != NULL)
+		TAILQ_INSERT_TAIL(&buf->buf_chains, ch, ch_entry);
+	ch->ch_len += n;
+	buf->buf_len += n;
+	evbuffer_changed(buf, olen);
+
+	return (n);
+#else
+	return (evbuffer_read(buf, fd, howmuch));
+#endif
+}
+
+int
+evbuffer_write_atmost(struct evbuffer *buf, int fd, ssize_t howmuch)
+{
+	struct evbuffer_chain *ch;
+	struct iovec iov[EVBUFFER_IOVS];
+	size_t len, olen = buf->buf_len;
+	int niov = 0;
+	ssize_t n;
+#if defined(EVENT_HAS_SENDFILE)
+	off_t off;
+#endif
+
+	if (howmuch < 0 || (size_t)howmuch > buf->buf_len)
+		howmuch = buf->buf_len;
+	if (howmuch == 0)
+		return (0);
+
+	/* a 0 byte write would look like eof, so skip empty chains */
+	while ((ch = TAILQ_FIRST(&buf->buf_chains))->ch_len == 0) {
+		TAILQ_REMOVE(&buf->buf_chains, ch, ch_entry);
+		evbuffer_chain_free(ch);
+	}
+
+	len = ((size_t)howmuch < ch->ch_len) ? (size_t)howmuch : ch->ch_len;
+
+	switch (ch->ch_blk->eb_type) {
+#if defined(EVENT_HAS_SENDFILE)
+	case EVBUFFER_BLK_FILE:
+		off = ch->ch_blk->eb_off + ch->ch_off;
+		n = sendfile(fd, ch->ch_blk->eb_fds[0], &off, len);
+		break;
+#endif
+#if defined(EVENT_HAS_SPLICE)
+	case EVBUFFER_BLK_PIPE:
+		n = splice(ch->ch_blk->eb_fds[0], NULL, fd, NULL, len,
+		    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		break;
+#endif
+	default:
+		/* gather up the chains in memory */
+		len = howmuch;
+		for (; ch != NULL && niov < EVBUFFER_IOVS && len > 0;
+		    ch = TAILQ_NEXT(ch, ch_entry)) {
+			if (ch->ch_blk->eb_type != EVBUFFER_BLK_MEM &&
+			    ch->ch_blk->eb_type != EVBUFFER_BLK_REF)
+				break;
+
+			/* writev doesn't write to the iov_base memory */
+			iov[niov].iov_base = (void *)(uintptr_t)
+			    (ch->ch_blk->eb_data + ch->ch_off);
+			iov[niov].iov_len = (len < ch->ch_len) ?
+			    len : ch->ch_len;
+			len -= iov[niov].iov_len;
+			niov++;
+		}
+
+		n = writev(fd, iov, niov);
+		break;
+	}
+
+	if (n <= 0)
+		return (n);
+
+	/* what went out of a pipe has already left it */
+	evbuffer_trim(buf, n);
+	evbuffer_changed(buf, olen);
+
+	return (n);
+}
+
+int
+evbuffer_write(struct evbuffer *buf, int fd)
+{
+	return (evbuffer_write_atmost(buf, fd, -1));
+}
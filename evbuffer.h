@@ -0,0 +1,118 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2017 David Gwynne <dlg@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _LIB_EVBUFFER_H_
+#define _LIB_EVBUFFER_H_
+
+#include <sys/types.h>
+
+#include "minevent.h"
+
+struct evbuffer;
+
+struct evbuffer		*evbuffer_new(void);
+void			 evbuffer_free(struct evbuffer *);
+size_t			 evbuffer_get_length(const struct evbuffer *);
+void			 evbuffer_setcb(struct evbuffer *,
+			     void (*)(struct evbuffer *, size_t, size_t,
+			     void *), void *);
+
+int			 evbuffer_add(struct evbuffer *, const void *, size_t);
+int			 evbuffer_add_reference(struct evbuffer *,
+			     const void *, size_t,
+			     void (*)(const void *, size_t, void *), void *);
+int			 evbuffer_add_buffer(struct evbuffer *,
+			     struct evbuffer *);
+int			 evbuffer_add_buffer_reference(struct evbuffer *,
+			     struct evbuffer *);
+int			 evbuffer_add_file(struct evbuffer *, int, off_t,
+			     off_t);
+
+int			 evbuffer_remove(struct evbuffer *, void *, size_t);
+int			 evbuffer_drain(struct evbuffer *, size_t);
+unsigned char		*evbuffer_pullup(struct evbuffer *, ssize_t);
+
+int			 evbuffer_read(struct evbuffer *, int, int);
+int			 evbuffer_read_splice(struct evbuffer *, int, int);
+int			 evbuffer_write(struct evbuffer *, int);
+int			 evbuffer_write_atmost(struct evbuffer *, int, ssize_t);
+
+#define EVBUFFER_LENGTH(_b)	evbuffer_get_length(_b)
+
+/*
+ * bufferevents, like libevent 1.4.
+ */
+
+struct bufferevent;
+
+typedef void (*evbuffercb)(struct bufferevent *, void *);
+typedef void (*everrorcb)(struct bufferevent *, short, void *);
+
+#define EVBUFFER_READ		0x01
+#define EVBUFFER_WRITE		0x02
+#define EVBUFFER_EOF		0x10
+#define EVBUFFER_ERROR		0x20
+#define EVBUFFER_TIMEOUT	0x40
+
+struct event_watermark {
+	size_t			  low;
+	size_t			  high;
+};
+
+struct bufferevent {
+	struct event		  ev_read;
+	struct event		  ev_write;
+
+	struct evbuffer		 *input;
+	struct evbuffer		 *output;
+
+	struct event_watermark	  wm_read;
+	struct event_watermark	  wm_write;
+
+	evbuffercb		  readcb;
+	evbuffercb		  writecb;
+	everrorcb		  errorcb;
+	void			 *cbarg;
+
+	int			  timeout_read; /* in seconds */
+	int			  timeout_write; /* in seconds */
+
+	short			  enabled;
+	short			  flags;
+};
+
+struct bufferevent	*bufferevent_new(int, evbuffercb, evbuffercb,
+			     everrorcb, void *);
+int			 bufferevent_base_set(struct event_base *,
+			     struct bufferevent *);
+void			 bufferevent_free(struct bufferevent *);
+int			 bufferevent_enable(struct bufferevent *, short);
+int			 bufferevent_disable(struct bufferevent *, short);
+int			 bufferevent_write(struct bufferevent *,
+			     const void *, size_t);
+int			 bufferevent_write_buffer(struct bufferevent *,
+			     struct evbuffer *);
+size_t			 bufferevent_read(struct bufferevent *, void *,
+			     size_t);
+void			 bufferevent_setwatermark(struct bufferevent *, short,
+			     size_t, size_t);
+void			 bufferevent_settimeout(struct bufferevent *,
+			     int, int);
+int			 bufferevent_splice(struct bufferevent *, int);
+
+#endif /* _LIB_EVBUFFER_H_ */
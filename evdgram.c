@@ -0,0 +1,412 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2017 David Gwynne <dlg@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * datagram events.
+ *
+ * when the fd is readable up to a batch of messages are received at
+ * once into an arena that is allocated up front and reused, and the
+ * callback gets all of them together. messages to send are copied onto
+ * a ring of the same size, and go out together when the fd is writable
+ * so everything sent by the callbacks in one loop shares a syscall.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "minevent.h"
+#include "minevent-internal.h"
+#include "evdgram.h"
+
+struct evdgram {
+	struct event		  dg_rev;
+	struct event		  dg_wev;
+	unsigned int		  dg_batch;
+	size_t			  dg_msgsize;
+	evdgramcb		  dg_fn;
+	void			 *dg_arg;
+	int			  dg_added;
+
+	/* the receive arena */
+	unsigned char		 *dg_rbuf;
+	struct iovec		 *dg_riov;
+	struct sockaddr_storage	 *dg_raddr;
+	struct evdgram_msg	 *dg_rmsgs;
+
+	/* the send ring */
+	unsigned char		 *dg_sbuf;
+	struct iovec		 *dg_siov;
+	struct sockaddr_storage	 *dg_saddr;
+	socklen_t		 *dg_saddrlen;
+	unsigned int		  dg_shead;
+	unsigned int		  dg_scount;
+
+#if defined(EVENT_HAS_MMSG)
+	struct mmsghdr		 *dg_hdrs;
+#endif
+};
+
+static void	evdgram_destroy(struct evdgram *);
+static void	evdgram_readcb(int, short, void *);
+static void	evdgram_writecb(int, short, void *);
+
+struct evdgram *
+evdgram_new(int fd, unsigned int batch, size_t msgsize, evdgramcb fn,
+    void *arg)
+{
+	struct evdgram *dg;
+	unsigned int i;
+
+	if (batch == 0 || msgsize == 0) {
+		errno = EINVAL;
+		return (NULL);
+	}
+
+	dg = calloc(1, sizeof(*dg));
+	if (dg == NULL)
+		return (NULL);
+
+	dg->dg_batch = batch;
+	dg->dg_msgsize = msgsize;
+	dg->dg_fn = fn;
+	dg->dg_arg = arg;
+
+	dg->dg_rbuf = reallocarray(NULL, batch, msgsize);
+	dg->dg_riov = reallocarray(NULL, batch, sizeof(*dg->dg_riov));
+	dg->dg_raddr = reallocarray(NULL, batch, sizeof(*dg->dg_raddr));
+	dg->dg_rmsgs = reallocarray(NULL, batch, sizeof(*dg->dg_rmsgs));
+	dg->dg_sbuf = reallocarray(NULL, batch, msgsize);
+	dg->dg_siov = reallocarray(NULL, batch, sizeof(*dg->dg_siov));
+	dg->dg_saddr = reallocarray(NULL, batch, sizeof(*dg->dg_saddr));
+	dg->dg_saddrlen = reallocarray(NULL, batch,
+	    sizeof(*dg->dg_saddrlen));
+	if (dg->dg_rbuf == NULL || dg->dg_riov == NULL ||
+	    dg->dg_raddr == NULL || dg->dg_rmsgs == NULL ||
+	    dg->dg_sbuf == NULL || dg->dg_siov == NULL ||
+	    dg->dg_saddr == NULL || dg->dg_saddrlen == NULL)
+		goto fail;
+
+#if defined(EVENT_HAS_MMSG)
+	/* receiving and sending both happen on the loop, so share these */
+	dg->dg_hdrs = calloc(batch, sizeof(*dg->dg_hdrs));
+	if (dg->dg_hdrs == NULL)
+		goto fail;
+#endif
+
+	for (i = 0; i < batch; i++) {
+		dg->dg_riov[i].iov_base = dg->dg_rbuf + i * msgsize;
+		dg->dg_riov[i].iov_len = msgsize;
+		dg->dg_siov[i].iov_base = dg->dg_sbuf + i * msgsize;
+	}
+
+	event_set(&dg->dg_rev, fd, EV_READ|EV_PERSIST, evdgram_readcb, dg);
+	event_set(&dg->dg_wev, fd, EV_WRITE|EV_PERSIST, evdgram_writecb, dg);
+
+	return (dg);
+
+fail:
+	evdgram_destroy(dg);
+	errno = ENOMEM;
+	return (NULL);
+}
+
+int
+evdgram_base_set(struct event_base *evb, struct evdgram *dg)
+{
+	if (event_base_set(evb, &dg->dg_rev) == -1 ||
+	    event_base_set(evb, &dg->dg_wev) == -1)
+		return (-1);
+
+	return (0);
+}
+
+void
+evdgram_free(struct evdgram *dg)
+{
+	event_del(&dg->dg_rev);
+	event_del(&dg->dg_wev);
+
+	evdgram_destroy(dg);
+}
+
+static void
+evdgram_destroy(struct evdgram *dg)
+{
+#if defined(EVENT_HAS_MMSG)
+	free(dg->dg_hdrs);
+#endif
+	free(dg->dg_saddrlen);
+	free(dg->dg_saddr);
+	free(dg->dg_siov);
+	free(dg->dg_sbuf);
+	free(dg->dg_rmsgs);
+	free(dg->dg_raddr);
+	free(dg->dg_riov);
+	free(dg->dg_rbuf);
+	free(dg);
+}
+
+int
+evdgram_add(struct evdgram *dg)
+{
+	if (event_add(&dg->dg_rev, NULL) == -1)
+		return (-1);
+	dg->dg_added = 1;
+
+	/* start flushing what was queued while it was off the loop */
+	if (dg->dg_scount > 0 && event_add(&dg->dg_wev, NULL) == -1)
+		return (-1);
+
+	return (0);
+}
+
+int
+evdgram_del(struct evdgram *dg)
+{
+	dg->dg_added = 0;
+	if (event_del(&dg->dg_rev) == -1 || event_del(&dg->dg_wev) == -1)
+		return (-1);
+
+	return (0);
+}
+
+static int
+evdgram_recv(struct evdgram *dg, int fd)
+{
+	struct msghdr *msg;
+	unsigned int i;
+	int n;
+
+#if defined(EVENT_HAS_MMSG)
+	for (i = 0; i < dg->dg_batch; i++) {
+		msg = &dg->dg_hdrs[i].msg_hdr;
+		msg->msg_name = &dg->dg_raddr[i];
+		msg->msg_namelen = sizeof(dg->dg_raddr[i]);
+		msg->msg_iov = &dg->dg_riov[i];
+		msg->msg_iovlen = 1;
+		msg->msg_control = NULL;
+		msg->msg_controllen = 0;
+		msg->msg_flags = 0;
+	}
+
+	n = recvmmsg(fd, dg->dg_hdrs, dg->dg_batch, MSG_DONTWAIT, NULL);
+	if (n <= 0)
+		return (n);
+
+	for (i = 0; i < (unsigned int)n; i++) {
+		dg->dg_rmsgs[i].dm_len = dg->dg_hdrs[i].msg_len;
+		dg->dg_rmsgs[i].dm_addrlen =
+		    dg->dg_hdrs[i].msg_hdr.msg_namelen;
+		dg->dg_rmsgs[i].dm_flags = dg->dg_hdrs[i].msg_hdr.msg_flags;
+	}
+#else
+	struct msghdr hdr;
+	ssize_t len;
+
+	msg = &hdr;
+	for (i = 0; i < dg->dg_batch; i++) {
+		msg->msg_name = &dg->dg_raddr[i];
+		msg->msg_namelen = sizeof(dg->dg_raddr[i]);
+		msg->msg_iov = &dg->dg_riov[i];
+		msg->msg_iovlen = 1;
+		msg->msg_control = NULL;
+		msg->msg_controllen = 0;
+		msg->msg_flags = 0;
+
+		len = recvmsg(fd, msg, MSG_DONTWAIT);
+		if (len == -1)
+			break;
+
+		dg->dg_rmsgs[i].dm_len = len;
+		dg->dg_rmsgs[i].dm_addrlen = msg->msg_namelen;
+		dg->dg_rmsgs[i].dm_flags = msg->msg_flags;
+	}
+	if (i == 0)
+		return (-1);
+
+	n = i;
+#endif
+
+	return (n);
+}
+
+static void
+evdgram_readcb(int fd, short events, void *arg)
+{
+	struct evdgram *dg = arg;
+	unsigned int i;
+	int n;
+
+	/*
+	 * errors on datagram sockets are about earlier packets, like
+	 * icmp port unreachables, so there's nothing to do but move on.
+	 */
+	n = evdgram_recv(dg, fd);
+	if (n <= 0)
+		return;
+
+	for (i = 0; i < (unsigned int)n; i++) {
+		dg->dg_rmsgs[i].dm_buf = dg->dg_riov[i].iov_base;
+		dg->dg_rmsgs[i].dm_addr = (struct sockaddr *)&dg->dg_raddr[i];
+	}
+
+	(*dg->dg_fn)(dg, dg->dg_rmsgs, n, dg->dg_arg);
+}
+
+static int
+evdgram_sendq(struct evdgram *dg, int fd)
+{
+	struct msghdr *msg;
+	unsigned int i, slot;
+	int n;
+
+#if defined(EVENT_HAS_MMSG)
+	for (i = 0; i < dg->dg_scount; i++) {
+		slot = (dg->dg_shead + i) % dg->dg_batch;
+		msg = &dg->dg_hdrs[i].msg_hdr;
+		msg->msg_name = dg->dg_saddrlen[slot] ?
+		    &dg->dg_saddr[slot] : NULL;
+		msg->msg_namelen = dg->dg_saddrlen[slot];
+		msg->msg_iov = &dg->dg_siov[slot];
+		msg->msg_iovlen = 1;
+		msg->msg_control = NULL;
+		msg->msg_controllen = 0;
+		msg->msg_flags = 0;
+	}
+
+	n = sendmmsg(fd, dg->dg_hdrs, dg->dg_scount, MSG_DONTWAIT);
+#else
+	struct msghdr hdr;
+
+	msg = &hdr;
+	for (i = 0; i < dg->dg_scount; i++) {
+		slot = (dg->dg_shead + i) % dg->dg_batch;
+		msg->msg_name = dg->dg_saddrlen[slot] ?
+		    &dg->dg_saddr[slot] : NULL;
+		msg->msg_namelen = dg->dg_saddrlen[slot];
+		msg->msg_iov = &dg->dg_siov[slot];
+		msg->msg_iovlen = 1;
+		msg->msg_control = NULL;
+		msg->msg_controllen = 0;
+		msg->msg_flags = 0;
+
+		if (sendmsg(fd, msg, MSG_DONTWAIT) == -1)
+			break;
+	}
+	n = (i == 0) ? -1 : (int)i;
+#endif
+
+	return (n);
+}
+
+static int
+evdgram_async_error(int error)
+{
+	switch (error) {
+	case ECONNREFUSED:
+	case EHOSTUNREACH:
+	case ENETUNREACH:
+		return (1);
+	}
+
+	return (0);
+}
+
+static int
+evdgram_flush(struct evdgram *dg, int fd)
+{
+	int n;
+
+	n = evdgram_sendq(dg, fd);
+	if (n == -1 && evdgram_async_error(errno)) {
+		/*
+		 * a connected socket reports an error left by an earlier
+		 * packet, like an icmp port unreachable, instead of
+		 * sending. that clears it, so try again.
+		 */
+		n = evdgram_sendq(dg, fd);
+	}
+
+	if (n == -1) {
+		if (errno == EAGAIN || errno == EINTR || errno == ENOBUFS ||
+		    evdgram_async_error(errno))
+			return (-1);
+
+		/* the first message itself can't be sent, so drop it */
+		n = 1;
+	}
+
+	dg->dg_shead = (dg->dg_shead + n) % dg->dg_batch;
+	dg->dg_scount -= n;
+
+	return (0);
+}
+
+static void
+evdgram_writecb(int fd, short events, void *arg)
+{
+	struct evdgram *dg = arg;
+
+	evdgram_flush(dg, fd);
+	if (dg->dg_scount == 0)
+		event_del(&dg->dg_wev);
+}
+
+int
+evdgram_send(struct evdgram *dg, const void *buf, size_t len,
+    const struct sockaddr *sa, socklen_t salen)
+{
+	unsigned int slot;
+
+	if (len > dg->dg_msgsize || salen > sizeof(dg->dg_saddr[0])) {
+		errno = EMSGSIZE;
+		return (-1);
+	}
+
+	if (dg->dg_scount == dg->dg_batch) {
+		/* messages are only queued while it is off the loop */
+		if (!dg->dg_added) {
+			errno = ENOBUFS;
+			return (-1);
+		}
+
+		/* make room by sending what's there now */
+		if (evdgram_flush(dg, EVENT_FD(&dg->dg_wev)) == -1 &&
+		    dg->dg_scount == dg->dg_batch)
+			return (-1);
+	}
+
+	if (dg->dg_scount == 0 && dg->dg_added &&
+	    event_add(&dg->dg_wev, NULL) == -1)
+		return (-1);
+
+	slot = (dg->dg_shead + dg->dg_scount) % dg->dg_batch;
+	memcpy(dg->dg_siov[slot].iov_base, buf, len);
+	dg->dg_siov[slot].iov_len = len;
+	if (sa != NULL)
+		memcpy(&dg->dg_saddr[slot], sa, salen);
+	dg->dg_saddrlen[slot] = (sa != NULL) ? salen : 0;
+	dg->dg_scount++;
+
+	return (0);
+}
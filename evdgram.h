@@ -0,0 +1,51 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2017 David Gwynne <dlg@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _LIB_EVDGRAM_H_
+#define _LIB_EVDGRAM_H_
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "minevent.h"
+
+struct evdgram;
+
+/* a received message, only valid until the callback returns */
+struct evdgram_msg {
+	void			 *dm_buf;
+	size_t			  dm_len;
+	struct sockaddr		 *dm_addr;
+	socklen_t		  dm_addrlen;
+	int			  dm_flags; /* MSG_TRUNC and friends */
+};
+
+typedef void (*evdgramcb)(struct evdgram *, struct evdgram_msg *,
+    unsigned int, void *);
+
+struct evdgram		*evdgram_new(int, unsigned int, size_t, evdgramcb,
+			     void *);
+int			 evdgram_base_set(struct event_base *,
+			     struct evdgram *);
+void			 evdgram_free(struct evdgram *);
+int			 evdgram_add(struct evdgram *);
+int			 evdgram_del(struct evdgram *);
+int			 evdgram_send(struct evdgram *, const void *, size_t,
+			     const struct sockaddr *, socklen_t);
+
+#endif /* _LIB_EVDGRAM_H_ */
@@ -0,0 +1,527 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2017 David Gwynne <dlg@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "minevent.h"
+#include "minevent-internal.h"
+
+#if defined(EVENT_HAS_EPOLL)
+
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <errno.h>
+
+static void	*event_epoll_init(void);
+static void	 event_epoll_destroy(void *);
+static int	 event_epoll_dispatch(struct event_base *,
+		     const struct timespec *);
+static int	 event_epoll_event_add(struct event_base *, struct event *);
+static int	 event_epoll_event_del(struct event_base *, struct event *);
+static int	 event_epoll_event_mod(struct event_base *, struct event *,
+		     short);
+static int	 event_epoll_signal_add(struct event_base *, int);
+static int	 event_epoll_signal_del(struct event_base *, int);
+
+const struct event_ops event_epoll_ops = {
+	event_epoll_init,
+	event_epoll_destroy,
+	event_epoll_dispatch,
+	event_epoll_event_add,
+	event_epoll_event_del,
+	event_epoll_event_mod,
+	event_epoll_signal_add,
+	event_epoll_signal_del,
+};
+
+/*
+ * epoll only lets an fd be registered once, so the events for an fd are
+ * collected here. like kqueue, an fd may have one reader and one writer.
+ *
+ * changes to an fd the kernel already knows about are not sent to the
+ * kernel straight away. the fd is put on a changelist instead, and the
+ * list is flushed before the next epoll_wait. if an event is deleted
+ * and added again before then, eg, a non-persistent reader firing and
+ * being re-armed in its callback while a writer stays on the fd, the
+ * kernel only hears about it once.
+ *
+ * an event_del that leaves an fd with no events is never put on the
+ * list though, not even when a non-persistent event is deleted as it
+ * fires. the callbacks run before the list is flushed and may close
+ * the fd, and epoll only forgets an fd when the last reference to the
+ * file goes away. if it was dup'ed, a DEL after the close fails and
+ * the registration is stuck there firing with nothing to fire.
+ */
+struct event_epfd {
+	struct event	*evepfd_rd;
+	struct event	*evepfd_wr;
+	uint32_t	 evepfd_mask;	/* what the kernel has */
+	unsigned int	 evepfd_changed;
+};
+
+struct event_epoll {
+	int		  evep_fd;
+
+	struct event_epfd *
+			  evep_fds;
+	unsigned int	  evep_fdslen;
+	unsigned int	  evep_nfds;
+
+	int		 *evep_changes;
+	unsigned int	  evep_changeslen;
+	unsigned int	  evep_nchanges;
+
+	struct epoll_event *
+			  evep_events;
+	unsigned int	  evep_eventslen;
+
+	struct event_signals *
+			  evep_signals;
+};
+
+static void *
+event_epoll_init(void)
+{
+	struct event_epoll *evep;
+	int fd;
+
+	evep = malloc(sizeof(*evep));
+	if (evep == NULL)
+		return (NULL);
+
+	fd = epoll_create1(EPOLL_CLOEXEC);
+	if (fd == -1) {
+		free(evep);
+		return (NULL);
+	}
+
+	evep->evep_fd = fd;
+	evep->evep_fds = NULL;
+	evep->evep_fdslen = 0;
+	evep->evep_nfds = 0;
+	evep->evep_changes = NULL;
+	evep->evep_changeslen = 0;
+	evep->evep_nchanges = 0;
+	evep->evep_events = NULL;
+	evep->evep_eventslen = 0;
+	evep->evep_signals = NULL;
+
+	return (evep);
+}
+
+static void
+event_epoll_destroy(void *backend)
+{
+	struct event_epoll *evep = backend;
+
+	event_signals_destroy(evep->evep_signals);
+
+	free(evep->evep_events);
+	free(evep->evep_changes);
+	free(evep->evep_fds);
+	close(evep->evep_fd);
+	free(evep);
+}
+
+static uint32_t
+event_epoll_mask(const struct event_epfd *evepfd)
+{
+	uint32_t mask = 0;
+
+	if (evepfd->evepfd_rd != NULL)
+		SET(mask, EPOLLIN);
+	if (evepfd->evepfd_wr != NULL)
+		SET(mask, EPOLLOUT);
+
+	/* the fd is either edge or level triggered, see event_add */
+	if ((evepfd->evepfd_rd != NULL &&
+	     ISSET(evepfd->evepfd_rd->ev_event, EV_ET)) ||
+	    (evepfd->evepfd_wr != NULL &&
+	     ISSET(evepfd->evepfd_wr->ev_event, EV_ET)))
+		SET(mask, EPOLLET);
+
+#if defined(EPOLLEXCLUSIVE)
+	/* only wake one of the epoll fds waiting on a shared listener */
+	if (evepfd->evepfd_rd != NULL &&
+	    ISSET(evepfd->evepfd_rd->ev_event, EV_EXCLUSIVE))
+		SET(mask, EPOLLEXCLUSIVE);
+#endif
+
+	return (mask);
+}
+
+static int
+event_epoll_timeout(const struct timespec *ts)
+{
+	long long ms;
+
+	if (ts == NULL)
+		return (-1);
+
+	/* round up so we dont wake up just before the deadline */
+	ms = (long long)ts->tv_sec * 1000 + (ts->tv_nsec + 999999) / 1000000;
+	if (ms > INT_MAX)
+		return (INT_MAX);
+
+	return (ms);
+}
+
+static void
+event_epoll_fire(struct event_base *evb, struct event_epfd *evepfd,
+    short event)
+{
+	struct event *rd, *wr;
+
+	/*
+	 * firing a non-persistent event removes it from the fd, so
+	 * look at both of them before firing either.
+	 */
+	rd = evepfd->evepfd_rd;
+	wr = evepfd->evepfd_wr;
+
+	if (rd == wr) {
+		if (rd != NULL && ISSET(rd->ev_event, event)) {
+			event_fire_event(evb, rd,
+			    ISSET(event, EV_READ|EV_WRITE) | EV_PERSIST);
+		}
+		return;
+	}
+
+	if (rd != NULL && ISSET(event, EV_READ))
+		event_fire_event(evb, rd, EV_READ|EV_PERSIST);
+	if (wr != NULL && ISSET(event, EV_WRITE))
+		event_fire_event(evb, wr, EV_WRITE|EV_PERSIST);
+}
+
+static void
+event_epoll_change(struct event_epoll *evep, int fd)
+{
+	struct event_epfd *evepfd = &evep->evep_fds[fd];
+
+	if (evepfd->evepfd_changed)
+		return;
+
+	/* event_epoll_event_add made sure there's room */
+	evep->evep_changes[evep->evep_nchanges++] = fd;
+	evepfd->evepfd_changed = 1;
+}
+
+static void
+event_epoll_ctl(struct event_base *evb, struct event_epoll *evep, int fd)
+{
+	struct event_epfd *evepfd = &evep->evep_fds[fd];
+	struct epoll_event epev;
+	uint32_t mask;
+	int op = EPOLL_CTL_MOD;
+
+	mask = event_epoll_mask(evepfd);
+	if (mask == evepfd->evepfd_mask)
+		return;
+
+	if (mask == 0) {
+		if (evepfd->evepfd_mask == 0)
+			return;
+
+		/* this fails if the fd was closed before event_del */
+		(void)epoll_ctl(evep->evep_fd, EPOLL_CTL_DEL, fd, NULL);
+
+		evepfd->evepfd_mask = 0;
+		evep->evep_nfds--;
+		return;
+	}
+
+	epev.events = mask;
+	epev.data.fd = fd;
+
+#if defined(EPOLLEXCLUSIVE)
+	if (ISSET(mask | evepfd->evepfd_mask, EPOLLEXCLUSIVE)) {
+		/* exclusive fds can only be added, not modified */
+		if (evepfd->evepfd_mask != 0)
+			(void)epoll_ctl(evep->evep_fd, EPOLL_CTL_DEL, fd, NULL);
+		op = EPOLL_CTL_ADD;
+	}
+#endif
+
+	if (epoll_ctl(evep->evep_fd, op, fd, &epev) == -1) {
+		/*
+		 * only forget the kernel's mask if it really doesn't
+		 * have the fd. a MOD that failed for any other reason
+		 * left the old registration where it was.
+		 */
+		if ((op == EPOLL_CTL_ADD || errno == ENOENT) &&
+		    evepfd->evepfd_mask != 0) {
+			evepfd->evepfd_mask = 0;
+			evep->evep_nfds--;
+		}
+
+		/* the fd number may have been closed and reused */
+		if (op == EPOLL_CTL_ADD || errno != ENOENT ||
+		    epoll_ctl(evep->evep_fd, EPOLL_CTL_ADD, fd, &epev) == -1) {
+			/*
+			 * let the events find out what's wrong with the
+			 * fd. the fd is still on the changelist, so
+			 * removing them wont add it again.
+			 */
+			event_epoll_fire(evb, evepfd, EV_READ|EV_WRITE);
+			return;
+		}
+	}
+
+	if (evepfd->evepfd_mask == 0)
+		evep->evep_nfds++;
+	evepfd->evepfd_mask = mask;
+}
+
+static void
+event_epoll_flush(struct event_base *evb, struct event_epoll *evep)
+{
+	unsigned int i;
+	int fd;
+
+	for (i = 0; i < evep->evep_nchanges; i++) {
+		fd = evep->evep_changes[i];
+		event_epoll_ctl(evb, evep, fd);
+		evep->evep_fds[fd].evepfd_changed = 0;
+	}
+
+	evep->evep_nchanges = 0;
+}
+
+static int
+event_epoll_dispatch(struct event_base *evb, const struct timespec *ts)
+{
+	struct event_epoll *evep = event_base_backend(evb);
+	struct epoll_event *epevs, *epev;
+	unsigned int nevents;
+	short event;
+	int n, i;
+
+	if (event_signals_scan(evb, evep->evep_signals))
+		return (0);
+
+	/* a failed change fires its events, like epoll_wait does */
+	event_epoll_flush(evb, evep);
+
+	nevents = evep->evep_nfds;
+	if (nevents > evep->evep_eventslen || evep->evep_eventslen == 0) {
+		/* epoll_wait needs space for something */
+		nevents = event_grow(evep->evep_eventslen, nevents);
+		epevs = reallocarray(evep->evep_events, nevents,
+		    sizeof(*epevs));
+		if (epevs == NULL)
+			return (-1);
+
+		evep->evep_events = epevs;
+		evep->evep_eventslen = nevents;
+	} else {
+		nevents = evep->evep_eventslen;
+		epevs = evep->evep_events;
+	}
+
+	n = epoll_wait(evep->evep_fd, epevs, nevents,
+	    event_epoll_timeout(ts));
+	if (n == -1)
+		return (errno == EINTR ? 0 : -1);
+
+	for (i = 0; i < n; i++) {
+		epev = &epevs[i];
+
+		event = 0;
+		if (ISSET(epev->events, EPOLLHUP|EPOLLERR))
+			SET(event, EV_READ|EV_WRITE);
+		else {
+			if (ISSET(epev->events, EPOLLIN))
+				SET(event, EV_READ);
+			if (ISSET(epev->events, EPOLLOUT))
+				SET(event, EV_WRITE);
+		}
+
+		event_epoll_fire(evb, &evep->evep_fds[epev->data.fd], event);
+	}
+
+	return (0);
+}
+
+/*
+ * work out what the fd should look like with ev waiting for the events
+ * in ev_event, and either tell the kernel or put it on the changelist.
+ */
+static int
+event_epoll_set(struct event_epoll *evep, struct event *ev)
+{
+	struct event_epfd *evepfd, nevepfd;
+	struct epoll_event epev;
+	int fd = EVENT_FD(ev);
+
+	evepfd = &evep->evep_fds[fd];
+	nevepfd = *evepfd;
+
+	/* event_modify may be moving ev between reading and writing */
+	if (nevepfd.evepfd_rd == ev)
+		nevepfd.evepfd_rd = NULL;
+	if (nevepfd.evepfd_wr == ev)
+		nevepfd.evepfd_wr = NULL;
+
+	if (ISSET(ev->ev_event, EV_READ)) {
+		if (nevepfd.evepfd_rd != NULL) {
+			errno = EEXIST;
+			return (-1);
+		}
+		nevepfd.evepfd_rd = ev;
+	}
+
+	if (ISSET(ev->ev_event, EV_WRITE)) {
+		if (nevepfd.evepfd_wr != NULL) {
+			errno = EEXIST;
+			return (-1);
+		}
+		nevepfd.evepfd_wr = ev;
+	}
+
+	if (nevepfd.evepfd_rd != NULL && nevepfd.evepfd_wr != NULL &&
+	    ISSET(nevepfd.evepfd_rd->ev_event ^ nevepfd.evepfd_wr->ev_event,
+	    EV_ET)) {
+		/* epoll cant mix edge and level triggers on an fd */
+		errno = EINVAL;
+		return (-1);
+	}
+
+	if (evepfd->evepfd_mask == 0) {
+		/* add new fds now so errors go back to the caller */
+		epev.events = event_epoll_mask(&nevepfd);
+		epev.data.fd = fd;
+
+		if (epoll_ctl(evep->evep_fd, EPOLL_CTL_ADD, fd, &epev) == -1)
+			return (-1);
+
+		nevepfd.evepfd_mask = epev.events;
+		evep->evep_nfds++;
+	} else
+		event_epoll_change(evep, fd);
+
+	/* commit */
+	evepfd->evepfd_rd = nevepfd.evepfd_rd;
+	evepfd->evepfd_wr = nevepfd.evepfd_wr;
+	evepfd->evepfd_mask = nevepfd.evepfd_mask;
+
+	return (0);
+}
+
+static int
+event_epoll_event_add(struct event_base *evb, struct event *ev)
+{
+	struct event_epoll *evep = event_base_backend(evb);
+	struct event_epfd *evepfd;
+	int fd = EVENT_FD(ev);
+
+	if (fd < 0) {
+		errno = EBADF;
+		return (-1);
+	}
+
+	if ((unsigned int)fd >= evep->evep_fdslen) {
+		struct event_epfd *evepfds;
+		int *changes;
+		unsigned int len = evep->evep_fdslen;
+		unsigned int nlen = event_grow(len, fd + 1);
+
+		/* every fd can be on the changelist once */
+		changes = reallocarray(evep->evep_changes, nlen,
+		    sizeof(*changes));
+		if (changes == NULL)
+			return (-1);
+		evep->evep_changes = changes;
+		evep->evep_changeslen = nlen;
+
+		evepfds = reallocarray(evep->evep_fds, nlen, sizeof(*evepfds));
+		if (evepfds == NULL)
+			return (-1);
+
+		for (; len < nlen; len++) {
+			evepfd = &evepfds[len];
+			evepfd->evepfd_rd = NULL;
+			evepfd->evepfd_wr = NULL;
+			evepfd->evepfd_mask = 0;
+			evepfd->evepfd_changed = 0;
+		}
+
+		evep->evep_fds = evepfds;
+		evep->evep_fdslen = nlen;
+	}
+
+	return (event_epoll_set(evep, ev));
+}
+
+static int
+event_epoll_event_del(struct event_base *evb, struct event *ev)
+{
+	struct event_epoll *evep = event_base_backend(evb);
+	struct event_epfd *evepfd;
+	int fd = EVENT_FD(ev);
+
+	evepfd = &evep->evep_fds[fd];
+
+	if (evepfd->evepfd_rd == ev)
+		evepfd->evepfd_rd = NULL;
+	if (evepfd->evepfd_wr == ev)
+		evepfd->evepfd_wr = NULL;
+
+	if (evepfd->evepfd_rd == NULL && evepfd->evepfd_wr == NULL) {
+		/*
+		 * the fd may be closed as soon as we return, or by the
+		 * callback of a non-persistent event deleted as it fires.
+		 */
+		if (evepfd->evepfd_mask != 0) {
+			(void)epoll_ctl(evep->evep_fd, EPOLL_CTL_DEL, fd, NULL);
+			evepfd->evepfd_mask = 0;
+			evep->evep_nfds--;
+		}
+		return (0);
+	}
+
+	event_epoll_change(evep, fd);
+
+	return (0);
+}
+
+static int
+event_epoll_event_mod(struct event_base *evb, struct event *ev, short oevents)
+{
+	struct event_epoll *evep = event_base_backend(evb);
+
+	/* at most one EPOLL_CTL_MOD when the changelist is flushed */
+	return (event_epoll_set(evep, ev));
+}
+
+static int
+event_epoll_signal_add(struct event_base *evb, int s)
+{
+	struct event_epoll *evep = event_base_backend(evb);
+
+	return (event_signals_add(evb, &evep->evep_signals, s));
+}
+
+static int
+event_epoll_signal_del(struct event_base *evb, int s)
+{
+	struct event_epoll *evep = event_base_backend(evb);
+
+	return (event_signals_del(evb, &evep->evep_signals, s));
+}
+
+#endif /* EVENT_HAS_EPOLL */
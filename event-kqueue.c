@@ -16,14 +16,17 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include "minevent.h"
+#include "minevent-internal.h"
+
+#if defined(EVENT_HAS_KQUEUE)
+
 #include <sys/types.h>
 #include <sys/event.h>
 #include <sys/time.h>
 #include <unistd.h>
 #include <stdlib.h>
-
-#include "minevent.h"
-#include "minevent-internal.h"
+#include <errno.h>
 
 static void	*event_kq_init(void);
 static void	 event_kq_destroy(void *);
@@ -31,25 +34,46 @@ static int	 event_kq_dispatch(struct event_base *,
 		     const struct timespec *);
 static int	 event_kq_event_add(struct event_base *, struct event *);
 static int	 event_kq_event_del(struct event_base *, struct event *);
+static int	 event_kq_event_mod(struct event_base *, struct event *, short);
 static int	 event_kq_signal_add(struct event_base *, int);
 static int	 event_kq_signal_del(struct event_base *, int);
 
-const struct event_ops event_kqueue = {
+const struct event_ops event_kqueue_ops = {
 	event_kq_init,
 	event_kq_destroy,
 	event_kq_dispatch,
 	event_kq_event_add,
 	event_kq_event_del,
+	event_kq_event_mod,
 	event_kq_signal_add,
 	event_kq_signal_del,
 };
 
+/*
+ * fd changes are collected on a changelist and handed to the kernel
+ * with the kevent call that waits for events. each fd and filter only
+ * appears on the list once, so if an event is deleted and added again
+ * before the next dispatch, the kernel only sees the last change.
+ */
+struct event_kqfd {
+	int		 evkqfd_rd;	/* index on the changelist */
+	int		 evkqfd_wr;
+};
+
 struct event_kq {
 	int		 evkq_fd;
 
 	struct kevent	*evkq_events;
 	int		 evkq_eventslen;
 	int		 evkq_nevents;
+
+	struct kevent	*evkq_changes;
+	int		 evkq_changeslen;
+	int		 evkq_nchanges;
+
+	struct event_kqfd *
+			 evkq_fds;
+	unsigned int	 evkq_fdslen;
 };
 
 static void *
@@ -70,7 +94,13 @@ event_kq_init(void)
 
 	evkq->evkq_fd = fd;
 	evkq->evkq_events = NULL;
+	evkq->evkq_eventslen = 0;
 	evkq->evkq_nevents = 0;
+	evkq->evkq_changes = NULL;
+	evkq->evkq_changeslen = 0;
+	evkq->evkq_nchanges = 0;
+	evkq->evkq_fds = NULL;
+	evkq->evkq_fdslen = 0;
 
 	return (evkq);
 }
@@ -80,20 +110,66 @@ event_kq_destroy(void *backend)
 {
 	struct event_kq *evkq = backend;
 
+	free(evkq->evkq_fds);
+	free(evkq->evkq_changes);
 	free(evkq->evkq_events);
 	close(evkq->evkq_fd);
 	free(evkq);
 }
 
+/*
+ * make sure an event can be put on the changelist without failing.
+ */
+static int
+event_kq_reserve(struct event_kq *evkq, int fd)
+{
+	if (evkq->evkq_nchanges + 2 > evkq->evkq_changeslen) {
+		struct kevent *changes;
+		int len = event_grow(evkq->evkq_changeslen,
+		    evkq->evkq_nchanges + 2);
+
+		changes = reallocarray(evkq->evkq_changes, len,
+		    sizeof(*changes));
+		if (changes == NULL)
+			return (-1);
+
+		evkq->evkq_changes = changes;
+		evkq->evkq_changeslen = len;
+	}
+
+	if ((unsigned int)fd >= evkq->evkq_fdslen) {
+		struct event_kqfd *evkqfds;
+		unsigned int len = evkq->evkq_fdslen;
+		unsigned int nlen = event_grow(len, fd + 1);
+
+		evkqfds = reallocarray(evkq->evkq_fds, nlen, sizeof(*evkqfds));
+		if (evkqfds == NULL)
+			return (-1);
+
+		for (; len < nlen; len++) {
+			evkqfds[len].evkqfd_rd = -1;
+			evkqfds[len].evkqfd_wr = -1;
+		}
+
+		evkq->evkq_fds = evkqfds;
+		evkq->evkq_fdslen = nlen;
+	}
+
+	return (0);
+}
+
 static void
-event_kq_fire_event(struct event_base *evb, short flags, struct event *ev)
+event_kq_change(struct event_kq *evkq, int fd, short filter,
+    unsigned short flags, unsigned int fflags, struct event *ev)
 {
-	if (ISSET(ev->ev_event, EV_READ|EV_WRITE) != (EV_READ|EV_WRITE))
-		SET(flags, ISSET(ev->ev_event, EV_PERSIST));
-	else
-		SET(flags, EV_PERSIST);
+	struct event_kqfd *evkqfd = &evkq->evkq_fds[fd];
+	int *idx;
+
+	idx = (filter == EVFILT_READ) ? &evkqfd->evkqfd_rd : &evkqfd->evkqfd_wr;
+	if (*idx == -1)
+		*idx = evkq->evkq_nchanges++;
 
-	event_fire_event(evb, ev, flags);
+	EV_SET(&evkq->evkq_changes[*idx], fd, filter, flags, fflags, 0, ev);
 }
 
 static int
@@ -101,10 +177,14 @@ event_kq_dispatch(struct event_base *evb, const struct timespec *ts)
 {
 	struct event_kq *evkq = event_base_backend(evb);
 	struct kevent *kevs, *kev;
-	int nevents;
+	struct event_kqfd *evkqfd;
+	struct event *ev;
+	int nchanges, nevents;
 	int i;
 
-	nevents = evkq->evkq_nevents;
+	/* leave room for the kernel to report errors with the changes */
+	nchanges = evkq->evkq_nchanges;
+	nevents = evkq->evkq_nevents + nchanges;
 	if (nevents > evkq->evkq_eventslen) {
 		kevs = reallocarray(evkq->evkq_events, nevents, sizeof(*kevs));
 		if (kevs == NULL)
@@ -115,21 +195,47 @@ event_kq_dispatch(struct event_base *evb, const struct timespec *ts)
 	} else
 		kevs = evkq->evkq_events;
 
-	nevents = kevent(evkq->evkq_fd, NULL, 0, kevs, nevents, ts);
+	nevents = kevent(evkq->evkq_fd, evkq->evkq_changes, nchanges,
+	    kevs, nevents, ts);
+
+	/* the changelist has been handed to the kernel */
+	for (i = 0; i < nchanges; i++) {
+		kev = &evkq->evkq_changes[i];
+		evkqfd = &evkq->evkq_fds[kev->ident];
+		if (kev->filter == EVFILT_READ)
+			evkqfd->evkqfd_rd = -1;
+		else
+			evkqfd->evkqfd_wr = -1;
+	}
+	evkq->evkq_nchanges = 0;
+
 	if (nevents == -1)
-		return (-1);
+		return (errno == EINTR ? 0 : -1);
 
 	for (i = 0; i < nevents; i++) {
 		kev = &kevs[i];
+		ev = kev->udata;
+
+		if (ISSET(kev->flags, EV_ERROR)) {
+			/* deletes fail if the fd was closed first */
+			if (ev == NULL)
+				continue;
+
+			/* let the event find out what's wrong with the fd */
+			event_fire_event(evb, ev,
+			    ISSET(ev->ev_event, EV_READ|EV_WRITE) |
+			    EV_PERSIST);
+			continue;
+		}
 
 		switch (kev->filter) {
 		case EVFILT_READ:
-			event_kq_fire_event(evb, EV_READ, kev->udata);
+			event_fire_event(evb, ev, EV_READ|EV_PERSIST);
 			break;
 		case EVFILT_WRITE:
-			event_kq_fire_event(evb, EV_WRITE, kev->udata);
+			event_fire_event(evb, ev, EV_WRITE|EV_PERSIST);
 			break;
-		case EV_SIGNAL:
+		case EVFILT_SIGNAL:
 			event_fire_signal(evb, kev->ident);
 			break;
 		}
@@ -142,32 +248,30 @@ static int
 event_kq_event_add(struct event_base *evb, struct event *ev)
 {
 	struct event_kq *evkq = event_base_backend(evb);
-	struct kevent *kev, kevs[2];
-	int flags = EV_ADD;
-	int nchanges = 0;
+	unsigned short flags = EV_ADD;
+	int fd = EVENT_FD(ev);
 
-	if (ISSET(ev->ev_event, EV_READ|EV_WRITE) != (EV_READ|EV_WRITE) &&
-	    !ISSET(ev->ev_event, EV_PERSIST))
-		SET(flags, EV_ONESHOT);
+	if (fd < 0) {
+		errno = EBADF;
+		return (-1);
+	}
 
-	if (ISSET(ev->ev_event, EV_READ)) {
-		kev = &kevs[nchanges++];
+	if (event_kq_reserve(evkq, fd) == -1)
+		return (-1);
 
-		EV_SET(kev, EVENT_FD(ev), EVFILT_READ, flags, NOTE_EOF, 0, ev);
+	if (ISSET(ev->ev_event, EV_ET))
+		SET(flags, EV_CLEAR);
+
+	if (ISSET(ev->ev_event, EV_READ)) {
+		event_kq_change(evkq, fd, EVFILT_READ, flags, NOTE_EOF, ev);
+		evkq->evkq_nevents++;
 	}
 
 	if (ISSET(ev->ev_event, EV_WRITE)) {
-		kev = &kevs[nchanges++];
-
-		EV_SET(kev, EVENT_FD(ev), EVFILT_WRITE, flags, 0, 0, ev);
+		event_kq_change(evkq, fd, EVFILT_WRITE, flags, 0, ev);
+		evkq->evkq_nevents++;
 	}
 
-	/* commit */
-	if (kevent(evkq->evkq_fd, kevs, nchanges, NULL, 0, NULL) == -1)
-		return (-1);
-
-	evkq->evkq_nevents += nchanges;
-
 	return (0);
 }
 
@@ -175,26 +279,60 @@ static int
 event_kq_event_del(struct event_base *evb, struct event *ev)
 {
 	struct event_kq *evkq = event_base_backend(evb);
-	struct kevent *kev, kevs[2];
-	int nchanges = 0;
+	int fd = EVENT_FD(ev);
 
-	if (ISSET(ev->ev_event, EV_READ)) {
-		kev = &kevs[nchanges++];
+	if (event_kq_reserve(evkq, fd) == -1)
+		return (-1);
 
-		EV_SET(kev, EVENT_FD(ev), EVFILT_READ, EV_DELETE, 0, 0, ev);
+	/* the event may be freed before the kernel replies, so no udata */
+	if (ISSET(ev->ev_event, EV_READ)) {
+		event_kq_change(evkq, fd, EVFILT_READ, EV_DELETE, 0, NULL);
+		evkq->evkq_nevents--;
 	}
 
 	if (ISSET(ev->ev_event, EV_WRITE)) {
-		kev = &kevs[nchanges++];
+		event_kq_change(evkq, fd, EVFILT_WRITE, EV_DELETE, 0, NULL);
+		evkq->evkq_nevents--;
+	}
+
+	return (0);
+}
+
+static void
+event_kq_filter_mod(struct event_kq *evkq, struct event *ev, short filter,
+    short event, short oevents, unsigned short flags, unsigned int fflags)
+{
+	int fd = EVENT_FD(ev);
 
-		EV_SET(kev, EVENT_FD(ev), EVFILT_WRITE, EV_DELETE, 0, 0, ev);
+	if (ISSET(ev->ev_event, event)) {
+		if (ISSET(oevents, event))
+			return;
+
+		event_kq_change(evkq, fd, filter, flags, fflags, ev);
+		evkq->evkq_nevents++;
+	} else if (ISSET(oevents, event)) {
+		event_kq_change(evkq, fd, filter, EV_DELETE, 0, NULL);
+		evkq->evkq_nevents--;
 	}
+}
+
+static int
+event_kq_event_mod(struct event_base *evb, struct event *ev, short oevents)
+{
+	struct event_kq *evkq = event_base_backend(evb);
+	unsigned short flags = EV_ADD;
 
-	/* commit */
-	if (kevent(evkq->evkq_fd, kevs, nchanges, NULL, 0, NULL) == -1)
+	if (event_kq_reserve(evkq, EVENT_FD(ev)) == -1)
 		return (-1);
 
-	evkq->evkq_nevents -= nchanges;
+	if (ISSET(ev->ev_event, EV_ET))
+		SET(flags, EV_CLEAR);
+
+	/* only the filters that changed go on the changelist */
+	event_kq_filter_mod(evkq, ev, EVFILT_READ, EV_READ, oevents,
+	    flags, NOTE_EOF);
+	event_kq_filter_mod(evkq, ev, EVFILT_WRITE, EV_WRITE, oevents,
+	    flags, 0);
 
 	return (0);
 }
@@ -206,7 +344,7 @@ event_kq_signal_add(struct event_base *evb, int s)
 	struct kevent kev[1];
 	int rv;
 
-	EV_SET(&kev[0], s, EV_SIGNAL, EV_ADD, 0, 0, NULL);
+	EV_SET(&kev[0], s, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
 
 	rv = kevent(evkq->evkq_fd, kev, 1, NULL, 0, NULL);
 	if (rv == -1)
@@ -224,7 +362,7 @@ event_kq_signal_del(struct event_base *evb, int s)
 	struct kevent kev[1];
 	int rv;
 
-	EV_SET(&kev[0], s, EV_SIGNAL, EV_DELETE, 0, 0, NULL);
+	EV_SET(&kev[0], s, EVFILT_SIGNAL, EV_DELETE, 0, 0, NULL);
 
 	rv = kevent(evkq->evkq_fd, kev, 1, NULL, 0, NULL);
 	if (rv == -1)
@@ -234,3 +372,5 @@ event_kq_signal_del(struct event_base *evb, int s)
 
 	return (0);
 }
+
+#endif /* EVENT_HAS_KQUEUE */
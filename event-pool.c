@@ -0,0 +1,130 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2017 David Gwynne <dlg@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * a pool of fixed size items for backend records. items are allocated
+ * in chunks and are never given back until the pool is destroyed, so
+ * they do not move and an item can be looked up by its index even
+ * after it has been put back in the pool.
+ */
+
+#include <stdlib.h>
+
+#include "minevent.h"
+#include "minevent-internal.h"
+
+void
+event_pool_init(struct event_pool *evpl, size_t size)
+{
+	evpl->evpl_chunks = NULL;
+	evpl->evpl_nchunks = 0;
+	evpl->evpl_chunkslen = 0;
+	evpl->evpl_size = size;
+
+	evpl->evpl_free = NULL;
+	evpl->evpl_nfree = 0;
+	evpl->evpl_freelen = 0;
+}
+
+void
+event_pool_destroy(struct event_pool *evpl)
+{
+	unsigned int i;
+
+	for (i = 0; i < evpl->evpl_nchunks; i++)
+		free(evpl->evpl_chunks[i]);
+
+	free(evpl->evpl_chunks);
+	free(evpl->evpl_free);
+}
+
+static int
+event_pool_grow(struct event_pool *evpl)
+{
+	unsigned int nchunks = evpl->evpl_nchunks;
+	unsigned int nitems = (nchunks + 1) * EVENT_POOL_CHUNK;
+	unsigned int *idxs;
+	void **chunks;
+	void *chunk;
+	unsigned int i, len;
+
+	/* grow both arrays geometrically so startup stays linear */
+	if (nitems > evpl->evpl_freelen) {
+		len = event_grow(evpl->evpl_freelen, nitems);
+		idxs = reallocarray(evpl->evpl_free, len, sizeof(*idxs));
+		if (idxs == NULL)
+			return (-1);
+
+		evpl->evpl_free = idxs;
+		evpl->evpl_freelen = len;
+	} else
+		idxs = evpl->evpl_free;
+
+	if (nchunks + 1 > evpl->evpl_chunkslen) {
+		len = event_grow(evpl->evpl_chunkslen, nchunks + 1);
+		chunks = reallocarray(evpl->evpl_chunks, len,
+		    sizeof(*chunks));
+		if (chunks == NULL)
+			return (-1);
+
+		evpl->evpl_chunks = chunks;
+		evpl->evpl_chunkslen = len;
+	} else
+		chunks = evpl->evpl_chunks;
+
+	chunk = calloc(EVENT_POOL_CHUNK, evpl->evpl_size);
+	if (chunk == NULL)
+		return (-1);
+
+	/* commit */
+	chunks[nchunks] = chunk;
+	evpl->evpl_nchunks = nchunks + 1;
+
+	/* hand the new items out lowest index first */
+	for (i = 0; i < EVENT_POOL_CHUNK; i++)
+		idxs[evpl->evpl_nfree++] = nitems - 1 - i;
+
+	return (0);
+}
+
+unsigned int
+event_pool_get(struct event_pool *evpl)
+{
+	if (evpl->evpl_nfree == 0 && event_pool_grow(evpl) == -1)
+		return (EVENT_POOL_NONE);
+
+	return (evpl->evpl_free[--evpl->evpl_nfree]);
+}
+
+void
+event_pool_put(struct event_pool *evpl, unsigned int idx)
+{
+	evpl->evpl_free[evpl->evpl_nfree++] = idx;
+}
+
+unsigned int
+event_grow(unsigned int len, unsigned int need)
+{
+	if (len == 0)
+		len = 16;
+
+	while (len < need)
+		len *= 2;
+
+	return (len);
+}
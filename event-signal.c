@@ -0,0 +1,483 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2017 David Gwynne <dlg@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * signal handling for backends that cannot wait for signals themselves.
+ *
+ * by default a signal handler writes the signal number down a pipe, and
+ * the read side of the pipe is handled as a normal event on the base.
+ * with EVENT_HAS_SIGNALFD the signals are blocked and read from a
+ * signalfd instead, which also provides the siginfo for each signal.
+ *
+ * signal handlers and the signal mask are global, so each signal can
+ * only be handled by one base at a time.
+ */
+
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <errno.h>
+
+#include "minevent.h"
+#include "minevent-internal.h"
+
+#if defined(EVENT_HAS_SIGNALFD)
+#include <sys/signalfd.h>
+#endif
+
+#ifndef nitems
+#define nitems(_a)	(sizeof((_a)) / sizeof((_a)[0]))
+#endif
+
+struct event_signals {
+#if defined(EVENT_HAS_SIGNALFD)
+	sigset_t	  evs_mask;	/* signals on the signalfd */
+	sigset_t	  evs_blocked;	/* signals we blocked */
+	int		  evs_fd;
+#else
+	void		(*evs_handlers[NSIG])(int);
+
+	volatile sig_atomic_t
+			  evs_signals[NSIG];
+	volatile sig_atomic_t
+			  evs_rescan;
+
+	int		  evs_pipe[2];
+#endif
+	struct event	  evs_ev;
+
+	unsigned int	  evs_refcnt;
+};
+
+static struct event_signals *_evs[NSIG];
+
+static struct event_signals *
+		 event_signals_create(struct event_base *);
+static struct event_signals *
+		 event_signals_take(struct event_base *,
+		     struct event_signals **);
+static void	 event_signals_rele(struct event_signals **,
+		     struct event_signals *);
+static int	 event_signals_set(struct event_signals *, int);
+static int	 event_signals_clr(struct event_signals *, int);
+static void	 event_signals_read(int, short, void *);
+
+int
+event_signals_add(struct event_base *evb, struct event_signals **evsp, int s)
+{
+	struct event_signals *evs;
+
+	if (_evs[s] != NULL) {
+		/* another base is handling this signal */
+		errno = EBUSY;
+		return (-1);
+	}
+
+	evs = event_signals_take(evb, evsp);
+	if (evs == NULL)
+		return (-1);
+
+	_evs[s] = evs;
+	if (event_signals_set(evs, s) == -1) {
+		_evs[s] = NULL;
+		event_signals_rele(evsp, evs);
+		return (-1);
+	}
+
+	return (0);
+}
+
+int
+event_signals_del(struct event_base *evb, struct event_signals **evsp, int s)
+{
+	struct event_signals *evs = *evsp;
+
+	if (event_signals_clr(evs, s) == -1)
+		return (-1);
+
+	_evs[s] = NULL;
+	event_signals_rele(evsp, evs);
+
+	return (0);
+}
+
+static struct event_signals *
+event_signals_take(struct event_base *evb, struct event_signals **evsp)
+{
+	struct event_signals *evs;
+
+	evs = *evsp;
+	if (evs == NULL) {
+		evs = event_signals_create(evb);
+		if (evs == NULL)
+			return (NULL);
+
+		*evsp = evs; /* cache, not a ref */
+
+		return (evs); /* give the ref to the caller */
+	}
+
+	evs->evs_refcnt++;
+
+	return (evs);
+}
+
+static void
+event_signals_rele(struct event_signals **evsp, struct event_signals *evs)
+{
+	assert(*evsp == evs);
+
+	if (--evs->evs_refcnt == 0) {
+		*evsp = NULL;
+		event_signals_destroy(evs);
+	}
+}
+
+#if defined(EVENT_HAS_SIGNALFD)
+
+static struct event_signals *
+event_signals_create(struct event_base *evb)
+{
+	struct event_signals *evs;
+	struct event *ev;
+
+	evs = malloc(sizeof(*evs));
+	if (evs == NULL)
+		return (NULL);
+
+	sigemptyset(&evs->evs_mask);
+	sigemptyset(&evs->evs_blocked);
+	evs->evs_refcnt = 1;
+
+	evs->evs_fd = signalfd(-1, &evs->evs_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (evs->evs_fd == -1)
+		goto free;
+
+	ev = &evs->evs_ev;
+	event_set(ev, evs->evs_fd, EV_READ|EV_PERSIST,
+	    event_signals_read, evb);
+	event_base_set(evb, ev);
+	if (event_add(ev, NULL) != 0)
+		goto close;
+
+	return (evs);
+close:
+	close(evs->evs_fd);
+free:
+	free(evs);
+	return (NULL);
+}
+
+static int
+event_signals_set(struct event_signals *evs, int s)
+{
+	sigset_t set, oset;
+
+	/* the signal has to be blocked for the signalfd to get it */
+	sigemptyset(&set);
+	sigaddset(&set, s);
+	if (sigprocmask(SIG_BLOCK, &set, &oset) == -1)
+		return (-1);
+
+	sigaddset(&evs->evs_mask, s);
+	if (signalfd(evs->evs_fd, &evs->evs_mask, 0) == -1) {
+		sigdelset(&evs->evs_mask, s);
+		if (!sigismember(&oset, s))
+			sigprocmask(SIG_UNBLOCK, &set, NULL);
+		return (-1);
+	}
+
+	if (!sigismember(&oset, s))
+		sigaddset(&evs->evs_blocked, s);
+
+	return (0);
+}
+
+static int
+event_signals_clr(struct event_signals *evs, int s)
+{
+	sigset_t set;
+
+	sigdelset(&evs->evs_mask, s);
+	if (signalfd(evs->evs_fd, &evs->evs_mask, 0) == -1) {
+		sigaddset(&evs->evs_mask, s);
+		return (-1);
+	}
+
+	if (sigismember(&evs->evs_blocked, s)) {
+		sigemptyset(&set);
+		sigaddset(&set, s);
+		sigprocmask(SIG_UNBLOCK, &set, NULL);
+		sigdelset(&evs->evs_blocked, s);
+	}
+
+	return (0);
+}
+
+static void
+event_signals_read(int fd, short events, void *arg)
+{
+	struct event_base *evb = arg;
+	struct signalfd_siginfo ssis[32], *ssi;
+	struct event_siginfo esi;
+	sigset_t fired;
+	int sigs[NSIG];
+	unsigned int nsigs = 0;
+	ssize_t len;
+	size_t i, n;
+	int s;
+
+	sigemptyset(&fired);
+
+	do {
+		len = read(fd, ssis, sizeof(ssis));
+		if (len == -1) {
+			switch (errno) {
+			case EAGAIN:
+			case EINTR:
+				/* try again later */
+				len = 0;
+				break;
+			default:
+				abort();
+			}
+		}
+
+		n = len / sizeof(*ssi);
+		for (i = 0; i < n; i++) {
+			ssi = &ssis[i];
+			s = ssi->ssi_signo;
+			if (s <= 0 || s >= NSIG)
+				continue;
+
+			esi.esi_signo = s;
+			esi.esi_code = ssi->ssi_code;
+			esi.esi_pid = ssi->ssi_pid;
+			esi.esi_uid = ssi->ssi_uid;
+			esi.esi_status = ssi->ssi_status;
+			event_set_siginfo(evb, &esi);
+
+			if (!sigismember(&fired, s)) {
+				sigaddset(&fired, s);
+				sigs[nsigs++] = s;
+			}
+		}
+	} while (n == nitems(ssis));
+
+	/* only fire each signal once per read */
+	for (i = 0; i < nsigs; i++)
+		event_fire_signal(evb, sigs[i]);
+}
+
+void
+event_signals_destroy(struct event_signals *evs)
+{
+	sigset_t set;
+	int i;
+
+	if (evs == NULL)
+		return;
+
+	if (event_del(&evs->evs_ev) != 0) {
+		/* backends cannot fail to remove the signalfd */
+		abort();
+	}
+
+	sigemptyset(&set);
+	for (i = 1; i < NSIG; i++) {
+		if (sigismember(&evs->evs_mask, i))
+			_evs[i] = NULL;
+		if (sigismember(&evs->evs_blocked, i))
+			sigaddset(&set, i);
+	}
+	/*
+	 * the mask is per thread, so this only unblocks the signals in
+	 * the thread freeing the base. other threads keep them blocked.
+	 */
+	sigprocmask(SIG_UNBLOCK, &set, NULL);
+
+	close(evs->evs_fd);
+
+	free(evs);
+}
+
+int
+event_signals_scan(struct event_base *evb, struct event_signals *evs)
+{
+	/* the signalfd doesn't lose signals, so there's nothing to scan */
+	return (0);
+}
+
+#else /* EVENT_HAS_SIGNALFD */
+
+static void	 event_signals_handler(int);
+
+static struct event_signals *
+event_signals_create(struct event_base *evb)
+{
+	struct event_signals *evs;
+	struct event *ev;
+	int i;
+
+	evs = malloc(sizeof(*evs));
+	if (evs == NULL)
+		return (NULL);
+
+	if (pipe2(evs->evs_pipe, O_NONBLOCK) == -1)
+		goto free;
+
+	for (i = 0; i < NSIG; i++) {
+		evs->evs_handlers[i] = SIG_ERR;
+		evs->evs_signals[i] = 0;
+	}
+	evs->evs_rescan = 0;
+	evs->evs_refcnt = 1;
+
+	ev = &evs->evs_ev;
+	event_set(ev, evs->evs_pipe[0], EV_READ|EV_PERSIST,
+	    event_signals_read, evb);
+	event_base_set(evb, ev);
+	if (event_add(ev, NULL) != 0)
+		goto close;
+
+	return (evs);
+close:
+	close(evs->evs_pipe[0]);
+	close(evs->evs_pipe[1]);
+free:
+	free(evs);
+	return (NULL);
+}
+
+static int
+event_signals_set(struct event_signals *evs, int s)
+{
+	void (*handler)(int);
+
+	handler = signal(s, event_signals_handler);
+	if (handler == SIG_ERR)
+		return (-1);
+
+	evs->evs_handlers[s] = handler;
+
+	return (0);
+}
+
+static int
+event_signals_clr(struct event_signals *evs, int s)
+{
+	if (signal(s, evs->evs_handlers[s]) == SIG_ERR)
+		return (-1);
+
+	evs->evs_handlers[s] = SIG_ERR;
+
+	return (0);
+}
+
+static void
+event_signals_read(int fd, short events, void *arg)
+{
+	struct event_base *evb = arg;
+	char sigs[1024];
+	ssize_t len, i;
+
+	len = read(fd, sigs, sizeof(sigs));
+	if (len == -1) {
+		switch (errno) {
+		case EAGAIN:
+		case EINTR:
+			/* try again later */
+			return;
+		default:
+			abort();
+		}
+	}
+
+	for (i = 0; i < len; i++)
+		event_fire_signal(evb, sigs[i]);
+}
+
+void
+event_signals_destroy(struct event_signals *evs)
+{
+	void (*handler)(int);
+	int i;
+
+	if (evs == NULL)
+		return;
+
+	if (event_del(&evs->evs_ev) != 0) {
+		/* backends cannot fail to remove the pipe */
+		abort();
+	}
+
+	for (i = 0; i < NSIG; i++) {
+		handler = evs->evs_handlers[i];
+		if (handler != SIG_ERR) {
+			signal(i, handler); /* XXX */
+			_evs[i] = NULL;
+		}
+	}
+
+	close(evs->evs_pipe[0]);
+	close(evs->evs_pipe[1]);
+
+	free(evs);
+}
+
+static void
+event_signals_handler(int s)
+{
+	struct event_signals *evs = _evs[s];
+	unsigned char c[1] = { s };
+
+	if (evs == NULL)
+		return;
+
+	if (write(evs->evs_pipe[1], c, sizeof(c)) != sizeof(c)) {
+		/* if we fail to write to the pipe, fall back to a flag */
+		evs->evs_signals[s] = 1;
+		evs->evs_rescan = 1;
+	}
+}
+
+int
+event_signals_scan(struct event_base *evb, struct event_signals *evs)
+{
+	int rv = 0;
+	int s;
+
+	if (evs == NULL || !evs->evs_rescan)
+		return (0);
+
+	evs->evs_rescan = 0;
+
+	for (s = 0; s < NSIG; s++) {
+		if (evs->evs_signals[s]) {
+			evs->evs_signals[s] = 0;
+			event_fire_signal(evb, s);
+			rv = 1;
+		}
+	}
+
+	return (rv);
+}
+
+#endif /* EVENT_HAS_SIGNALFD */
@@ -0,0 +1,586 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2017 David Gwynne <dlg@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "minevent.h"
+#include "minevent-internal.h"
+
+#if defined(EVENT_HAS_IO_URING)
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <endian.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#define EVENT_URING_ENTRIES	512
+
+/*
+ * completions are matched back to polls with the index of the poll and
+ * a generation number, so completions for polls that have since been
+ * removed and reused can be ignored. a couple of values are reserved
+ * for the completions of internal sqes.
+ */
+#define EVENT_URING_TIMEOUT	(~0ULL)
+#define EVENT_URING_IGNORE	(~0ULL - 1)
+
+static void	*event_uring_init(void);
+static void	 event_uring_destroy(void *);
+static int	 event_uring_dispatch(struct event_base *,
+		     const struct timespec *);
+static int	 event_uring_event_add(struct event_base *, struct event *);
+static int	 event_uring_event_del(struct event_base *, struct event *);
+static int	 event_uring_event_mod(struct event_base *, struct event *,
+		     short);
+static int	 event_uring_signal_add(struct event_base *, int);
+static int	 event_uring_signal_del(struct event_base *, int);
+
+const struct event_ops event_uring_ops = {
+	event_uring_init,
+	event_uring_destroy,
+	event_uring_dispatch,
+	event_uring_event_add,
+	event_uring_event_del,
+	event_uring_event_mod,
+	event_uring_signal_add,
+	event_uring_signal_del,
+};
+
+struct event_uring_poll {
+	struct event	*evurp_ev;
+	uint32_t	 evurp_gen;
+	unsigned int	 evurp_armed;
+	unsigned int	 evurp_rearm;	/* on the rearm list */
+	unsigned int	 evurp_next;
+};
+
+struct event_uring {
+	int		  evur_fd;
+
+	void		 *evur_sq_ring;
+	size_t		  evur_sq_ringlen;
+	unsigned int	 *evur_sq_head;
+	unsigned int	 *evur_sq_tail;
+	unsigned int	  evur_sq_mask;
+	unsigned int	  evur_sq_entries;
+	unsigned int	  evur_sq_ptail;	/* private tail */
+	struct io_uring_sqe *
+			  evur_sqes;
+	size_t		  evur_sqeslen;
+
+	void		 *evur_cq_ring;
+	size_t		  evur_cq_ringlen;
+	unsigned int	 *evur_cq_head;
+	unsigned int	 *evur_cq_tail;
+	unsigned int	  evur_cq_mask;
+	struct io_uring_cqe *
+			  evur_cqes;
+
+	struct event_pool evur_polls;
+	unsigned int	  evur_rearm;	/* polls that couldn't be rearmed */
+
+	struct __kernel_timespec
+			  evur_ts;
+
+	struct event_signals *
+			  evur_signals;
+};
+
+static int
+event_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return (syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int
+event_uring_enter(struct event_uring *evur, unsigned int wait,
+    unsigned int flags)
+{
+	unsigned int submit;
+
+	/* publish the sqes before the kernel goes looking at them */
+	__atomic_store_n(evur->evur_sq_tail, evur->evur_sq_ptail,
+	    __ATOMIC_RELEASE);
+	submit = evur->evur_sq_ptail -
+	    __atomic_load_n(evur->evur_sq_head, __ATOMIC_ACQUIRE);
+
+	return (syscall(__NR_io_uring_enter, evur->evur_fd, submit, wait,
+	    flags, NULL, 0));
+}
+
+static void *
+event_uring_init(void)
+{
+	struct event_uring *evur;
+	struct io_uring_params p;
+	unsigned int *array;
+	char *sq, *cq;
+	unsigned int i;
+	int fd;
+
+	evur = malloc(sizeof(*evur));
+	if (evur == NULL)
+		return (NULL);
+
+	memset(&p, 0, sizeof(p));
+	fd = event_uring_setup(EVENT_URING_ENTRIES, &p);
+	if (fd == -1)
+		goto free;
+
+	/*
+	 * older kernels drop completions when the cq overflows, and a
+	 * poll whose completion is lost is never armed again.
+	 */
+	if (!ISSET(p.features, IORING_FEAT_NODROP)) {
+		errno = EOPNOTSUPP;
+		goto close;
+	}
+
+	evur->evur_fd = fd;
+	evur->evur_sq_ringlen = p.sq_off.array +
+	    p.sq_entries * sizeof(unsigned int);
+	evur->evur_cq_ringlen = p.cq_off.cqes +
+	    p.cq_entries * sizeof(struct io_uring_cqe);
+
+	if (ISSET(p.features, IORING_FEAT_SINGLE_MMAP)) {
+		if (evur->evur_cq_ringlen > evur->evur_sq_ringlen)
+			evur->evur_sq_ringlen = evur->evur_cq_ringlen;
+		evur->evur_cq_ringlen = evur->evur_sq_ringlen;
+	}
+
+	sq = mmap(NULL, evur->evur_sq_ringlen, PROT_READ|PROT_WRITE,
+	    MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto close;
+
+	if (ISSET(p.features, IORING_FEAT_SINGLE_MMAP))
+		cq = sq;
+	else {
+		cq = mmap(NULL, evur->evur_cq_ringlen, PROT_READ|PROT_WRITE,
+		    MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			goto unmap_sq;
+	}
+
+	evur->evur_sqeslen = p.sq_entries * sizeof(struct io_uring_sqe);
+	evur->evur_sqes = mmap(NULL, evur->evur_sqeslen,
+	    PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd,
+	    IORING_OFF_SQES);
+	if (evur->evur_sqes == MAP_FAILED)
+		goto unmap_cq;
+
+	evur->evur_sq_ring = sq;
+	evur->evur_sq_head = (unsigned int *)(sq + p.sq_off.head);
+	evur->evur_sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	evur->evur_sq_mask = *(unsigned int *)(sq + p.sq_off.ring_mask);
+	evur->evur_sq_entries = p.sq_entries;
+	evur->evur_sq_ptail = *evur->evur_sq_tail;
+
+	/* sqes are always used in ring order */
+	array = (unsigned int *)(sq + p.sq_off.array);
+	for (i = 0; i < p.sq_entries; i++)
+		array[i] = i;
+
+	evur->evur_cq_ring = cq;
+	evur->evur_cq_head = (unsigned int *)(cq + p.cq_off.head);
+	evur->evur_cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	evur->evur_cq_mask = *(unsigned int *)(cq + p.cq_off.ring_mask);
+	evur->evur_cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	event_pool_init(&evur->evur_polls, sizeof(struct event_uring_poll));
+	evur->evur_rearm = EVENT_POOL_NONE;
+
+	evur->evur_signals = NULL;
+
+	return (evur);
+
+unmap_cq:
+	if (cq != sq)
+		munmap(cq, evur->evur_cq_ringlen);
+unmap_sq:
+	munmap(sq, evur->evur_sq_ringlen);
+close:
+	close(fd);
+free:
+	free(evur);
+	return (NULL);
+}
+
+static void
+event_uring_destroy(void *backend)
+{
+	struct event_uring *evur = backend;
+
+	event_signals_destroy(evur->evur_signals);
+
+	munmap(evur->evur_sqes, evur->evur_sqeslen);
+	if (evur->evur_cq_ring != evur->evur_sq_ring)
+		munmap(evur->evur_cq_ring, evur->evur_cq_ringlen);
+	munmap(evur->evur_sq_ring, evur->evur_sq_ringlen);
+	close(evur->evur_fd);
+
+	event_pool_destroy(&evur->evur_polls);
+	free(evur);
+}
+
+static struct io_uring_sqe *
+event_uring_sqe(struct event_uring *evur)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int head;
+
+	head = __atomic_load_n(evur->evur_sq_head, __ATOMIC_ACQUIRE);
+	if (evur->evur_sq_ptail - head == evur->evur_sq_entries) {
+		/* the ring is full, push what we have to the kernel */
+		if (event_uring_enter(evur, 0, 0) == -1)
+			return (NULL);
+	}
+
+	sqe = &evur->evur_sqes[evur->evur_sq_ptail & evur->evur_sq_mask];
+	evur->evur_sq_ptail++;
+
+	memset(sqe, 0, sizeof(*sqe));
+
+	return (sqe);
+}
+
+static inline struct event_uring_poll *
+event_uring_poll(struct event_uring *evur, unsigned int idx)
+{
+	return (event_pool_item(&evur->evur_polls, idx));
+}
+
+static inline uint64_t
+event_uring_poll_data(struct event_uring *evur, unsigned int idx)
+{
+	return ((uint64_t)event_uring_poll(evur, idx)->evurp_gen << 32 | idx);
+}
+
+static void
+event_uring_rearm_remove(struct event_uring *evur, unsigned int idx)
+{
+	struct event_uring_poll *evurp;
+	unsigned int *next = &evur->evur_rearm;
+
+	/* the list is only used when the sq can't be pushed, so walk it */
+	while (*next != idx) {
+		evurp = event_uring_poll(evur, *next);
+		next = &evurp->evurp_next;
+	}
+
+	evurp = event_uring_poll(evur, idx);
+	*next = evurp->evurp_next;
+	evurp->evurp_rearm = 0;
+}
+
+static void
+event_uring_poll_put(struct event_uring *evur, unsigned int idx)
+{
+	struct event_uring_poll *evurp = event_uring_poll(evur, idx);
+
+	if (evurp->evurp_rearm)
+		event_uring_rearm_remove(evur, idx);
+
+	/* bump the generation so stale completions are ignored */
+	evurp->evurp_ev = NULL;
+	evurp->evurp_gen++;
+	evurp->evurp_armed = 0;
+
+	event_pool_put(&evur->evur_polls, idx);
+}
+
+static inline uint32_t
+event_uring_poll_events(uint32_t events)
+{
+#if BYTE_ORDER == BIG_ENDIAN
+	/* the kernel reads poll32_events as swapped half words */
+	events = (events << 16) | (events >> 16);
+#endif
+	return (events);
+}
+
+static int
+event_uring_poll_arm(struct event_uring *evur, unsigned int idx)
+{
+	struct event_uring_poll *evurp = event_uring_poll(evur, idx);
+	struct event *ev = evurp->evurp_ev;
+	struct io_uring_sqe *sqe;
+
+	sqe = event_uring_sqe(evur);
+	if (sqe == NULL)
+		return (-1);
+
+	/*
+	 * multishot polls are edge triggered, which is what EV_ET asks
+	 * for but isnt what the rest of the library expects. persistent
+	 * level triggered events get a new oneshot poll queued after each
+	 * completion instead, which is submitted with everything else on
+	 * the next trip into the kernel.
+	 */
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = EVENT_FD(ev);
+	sqe->poll32_events = event_uring_poll_events(
+	    (ISSET(ev->ev_event, EV_READ) ? POLLIN : 0) |
+	    (ISSET(ev->ev_event, EV_WRITE) ? POLLOUT : 0));
+	if (ISSET(ev->ev_event, EV_ET|EV_PERSIST) == (EV_ET|EV_PERSIST))
+		sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = event_uring_poll_data(evur, idx);
+
+	evurp->evurp_armed = 1;
+
+	return (0);
+}
+
+static void
+event_uring_complete(struct event_base *evb, struct event_uring *evur,
+    const struct io_uring_cqe *cqe)
+{
+	struct event_uring_poll *evurp;
+	struct event *ev;
+	unsigned int idx;
+	short event = 0;
+
+	switch (cqe->user_data) {
+	case EVENT_URING_TIMEOUT:
+	case EVENT_URING_IGNORE:
+		return;
+	}
+
+	/* pool items dont move or go away, so this is always safe */
+	idx = cqe->user_data & 0xffffffff;
+	evurp = event_uring_poll(evur, idx);
+	if (evurp->evurp_gen != (uint32_t)(cqe->user_data >> 32) ||
+	    evurp->evurp_ev == NULL) {
+		/* this poll has already been removed */
+		return;
+	}
+
+	if (!ISSET(cqe->flags, IORING_CQE_F_MORE))
+		evurp->evurp_armed = 0;
+
+	ev = evurp->evurp_ev;
+
+	if (cqe->res < 0) {
+		if (cqe->res == -ECANCELED)
+			return;
+
+		/* let the event find out what's wrong with the fd */
+		SET(event, EV_READ|EV_WRITE);
+	} else if (ISSET(cqe->res, POLLHUP|POLLERR))
+		SET(event, EV_READ|EV_WRITE);
+	else {
+		if (ISSET(cqe->res, POLLIN))
+			SET(event, EV_READ);
+		if (ISSET(cqe->res, POLLOUT))
+			SET(event, EV_WRITE);
+	}
+
+	if (ISSET(ev->ev_event, EV_PERSIST) && !evurp->evurp_armed &&
+	    event_uring_poll_arm(evur, idx) == -1) {
+		/* the sq is stuck, try again on the next dispatch */
+		evurp->evurp_next = evur->evur_rearm;
+		evurp->evurp_rearm = 1;
+		evur->evur_rearm = idx;
+	}
+
+	if (ISSET(ev->ev_event, event))
+		event_fire_event(evb, ev, event | EV_PERSIST);
+}
+
+static int
+event_uring_dispatch(struct event_base *evb, const struct timespec *ts)
+{
+	struct event_uring *evur = event_base_backend(evb);
+	struct io_uring_sqe *sqe;
+	unsigned int head, tail, idx;
+	unsigned int wait = 1;
+
+	if (event_signals_scan(evb, evur->evur_signals))
+		return (0);
+
+	while (evur->evur_rearm != EVENT_POOL_NONE) {
+		idx = evur->evur_rearm;
+		if (event_uring_poll_arm(evur, idx) == -1) {
+			/* dont sleep while polls are missing */
+			wait = 0;
+			break;
+		}
+
+		event_uring_rearm_remove(evur, idx);
+	}
+
+	if (wait && ts != NULL) {
+		if (ts->tv_sec == 0 && ts->tv_nsec == 0)
+			wait = 0;
+		else {
+			sqe = event_uring_sqe(evur);
+			if (sqe == NULL)
+				return (-1);
+
+			evur->evur_ts.tv_sec = ts->tv_sec;
+			evur->evur_ts.tv_nsec = ts->tv_nsec;
+
+			/*
+			 * the timeout completes after it expires, or as
+			 * soon as any other completion is posted.
+			 */
+			sqe->opcode = IORING_OP_TIMEOUT;
+			sqe->addr = (uint64_t)(uintptr_t)&evur->evur_ts;
+			sqe->len = 1;
+			sqe->off = 1;
+			sqe->user_data = EVENT_URING_TIMEOUT;
+		}
+	}
+
+	if (event_uring_enter(evur, wait,
+	    wait ? IORING_ENTER_GETEVENTS : 0) == -1) {
+		switch (errno) {
+		case EINTR:
+		case EAGAIN:
+		case EBUSY:
+			/*
+			 * EBUSY means the cq overflowed. the kernel keeps
+			 * the extra completions (IORING_FEAT_NODROP) and
+			 * posts them once the ring below is drained.
+			 */
+			break;
+		default:
+			return (-1);
+		}
+	}
+
+	head = *evur->evur_cq_head;
+	tail = __atomic_load_n(evur->evur_cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		event_uring_complete(evb, evur,
+		    &evur->evur_cqes[head & evur->evur_cq_mask]);
+	}
+	__atomic_store_n(evur->evur_cq_head, head, __ATOMIC_RELEASE);
+
+	return (0);
+}
+
+static int
+event_uring_event_add(struct event_base *evb, struct event *ev)
+{
+	struct event_uring *evur = event_base_backend(evb);
+	unsigned int idx;
+
+	idx = event_pool_get(&evur->evur_polls);
+	if (idx == EVENT_POOL_NONE)
+		return (-1);
+
+	event_uring_poll(evur, idx)->evurp_ev = ev;
+	if (event_uring_poll_arm(evur, idx) == -1) {
+		event_uring_poll_put(evur, idx);
+		return (-1);
+	}
+
+	ev->ev_cookie = (void *)(uintptr_t)idx;
+
+	return (0);
+}
+
+static int
+event_uring_event_del(struct event_base *evb, struct event *ev)
+{
+	struct event_uring *evur = event_base_backend(evb);
+	unsigned int idx = (uintptr_t)ev->ev_cookie;
+	struct io_uring_sqe *sqe;
+
+	if (event_uring_poll(evur, idx)->evurp_armed) {
+		sqe = event_uring_sqe(evur);
+		if (sqe == NULL)
+			return (-1);
+
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->addr = event_uring_poll_data(evur, idx);
+		sqe->user_data = EVENT_URING_IGNORE;
+	}
+
+	event_uring_poll_put(evur, idx);
+	ev->ev_cookie = NULL;
+
+	return (0);
+}
+
+static int
+event_uring_event_mod(struct event_base *evb, struct event *ev, short oevents)
+{
+	struct event_uring *evur = event_base_backend(evb);
+	unsigned int idx = (uintptr_t)ev->ev_cookie;
+	struct event_uring_poll *evurp = event_uring_poll(evur, idx);
+	struct io_uring_sqe *sqe;
+	unsigned int armed = evurp->evurp_armed;
+	uint64_t data = event_uring_poll_data(evur, idx);
+
+	/* completions look at ev_event, so EV_PERSIST takes care of itself */
+	if (!ISSET(ev->ev_event ^ oevents, EV_READ|EV_WRITE))
+		return (0);
+
+	/*
+	 * replace the poll rather than update it, so a completion for
+	 * the old events that is already on the ring is ignored and the
+	 * new poll looks at the fd again.
+	 */
+	evurp->evurp_gen++;
+	if (event_uring_poll_arm(evur, idx) == -1) {
+		evurp->evurp_gen--;
+		return (-1);
+	}
+
+	/* the new poll replaces one waiting to be rearmed */
+	if (evurp->evurp_rearm)
+		event_uring_rearm_remove(evur, idx);
+
+	if (armed) {
+		sqe = event_uring_sqe(evur);
+		if (sqe == NULL) {
+			/* the old poll will complete and be ignored */
+			return (0);
+		}
+
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->addr = data;
+		sqe->user_data = EVENT_URING_IGNORE;
+	}
+
+	return (0);
+}
+
+static int
+event_uring_signal_add(struct event_base *evb, int s)
+{
+	struct event_uring *evur = event_base_backend(evb);
+
+	return (event_signals_add(evb, &evur->evur_signals, s));
+}
+
+static int
+event_uring_signal_del(struct event_base *evb, int s)
+{
+	struct event_uring *evur = event_base_backend(evb);
+
+	return (event_signals_del(evb, &evur->evur_signals, s));
+}
+
+#endif /* EVENT_HAS_IO_URING */
@@ -0,0 +1,267 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2017 David Gwynne <dlg@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * a hierarchical timing wheel.
+ *
+ * time is counted in ticks since the wheel was created. each level of
+ * the wheel has EVENT_WHEEL_SLOTS slots, and a slot on level n covers
+ * EVENT_WHEEL_SLOTS^n ticks. an event is put on the lowest level that
+ * can hold its deadline, and the slots on the upper levels are
+ * cascaded down onto the lower levels as the wheel turns. adding and
+ * removing an event is O(1).
+ *
+ * deadlines are rounded up to the next tick.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "minevent.h"
+#include "minevent-internal.h"
+
+#define EVENT_WHEEL_BITS	6
+#define EVENT_WHEEL_SLOTS	(1U << EVENT_WHEEL_BITS)
+#define EVENT_WHEEL_MASK	(EVENT_WHEEL_SLOTS - 1)
+#define EVENT_WHEEL_LEVELS	4
+#define EVENT_WHEEL_RANGE	(1ULL << (EVENT_WHEEL_BITS * EVENT_WHEEL_LEVELS))
+
+#define EVENT_WHEEL_NONE	(~0ULL)
+
+LIST_HEAD(event_wheel_slot, event);
+
+struct event_wheel {
+	struct event_wheel_slot	 ew_slots[EVENT_WHEEL_LEVELS]
+				     [EVENT_WHEEL_SLOTS];
+	struct event_wheel_slot	 ew_expired;
+
+	struct timespec		 ew_base;	/* time at tick 0 */
+	uint64_t		 ew_tick;	/* nsec per tick */
+	uint64_t		 ew_now;	/* current tick */
+};
+
+struct event_wheel *
+event_wheel_create(const struct timespec *tick, const struct timespec *now)
+{
+	struct event_wheel *ew;
+	unsigned int l, s;
+
+	ew = malloc(sizeof(*ew));
+	if (ew == NULL)
+		return (NULL);
+
+	for (l = 0; l < EVENT_WHEEL_LEVELS; l++) {
+		for (s = 0; s < EVENT_WHEEL_SLOTS; s++)
+			LIST_INIT(&ew->ew_slots[l][s]);
+	}
+	LIST_INIT(&ew->ew_expired);
+
+	ew->ew_base = *now;
+	ew->ew_tick = (uint64_t)tick->tv_sec * 1000000000ULL + tick->tv_nsec;
+	if (ew->ew_tick == 0)
+		ew->ew_tick = 1;
+	ew->ew_now = 0;
+
+	return (ew);
+}
+
+void
+event_wheel_destroy(struct event_wheel *ew)
+{
+	free(ew);
+}
+
+static uint64_t
+event_wheel_ticks(const struct event_wheel *ew, const struct timespec *ts,
+    int roundup)
+{
+	struct timespec diff;
+	uint64_t nsec;
+
+	if (timespeccmp(ts, &ew->ew_base, <))
+		return (0);
+
+	timespecsub(ts, &ew->ew_base, &diff);
+	nsec = (uint64_t)diff.tv_sec * 1000000000ULL + diff.tv_nsec;
+	if (roundup)
+		nsec += ew->ew_tick - 1;
+
+	return (nsec / ew->ew_tick);
+}
+
+static void
+event_wheel_ts(const struct event_wheel *ew, uint64_t t, struct timespec *ts)
+{
+	struct timespec diff;
+	uint64_t nsec = t * ew->ew_tick;
+
+	diff.tv_sec = nsec / 1000000000ULL;
+	diff.tv_nsec = nsec % 1000000000ULL;
+	timespecadd(&ew->ew_base, &diff, ts);
+}
+
+static void
+event_wheel_place(struct event_wheel *ew, struct event *ev)
+{
+	struct event_wheel_slot *slot;
+	uint64_t t, delta;
+	unsigned int l;
+
+	t = event_wheel_ticks(ew, &ev->ev_deadline, 1);
+	if (t <= ew->ew_now) {
+		slot = &ew->ew_expired;
+		goto insert;
+	}
+
+	delta = t - ew->ew_now;
+	if (delta >= EVENT_WHEEL_RANGE) {
+		/* park it as far out as we can and look again later */
+		delta = EVENT_WHEEL_RANGE - 1;
+		t = ew->ew_now + delta;
+	}
+
+	for (l = 0; l < EVENT_WHEEL_LEVELS - 1; l++) {
+		if (delta < (1ULL << (EVENT_WHEEL_BITS * (l + 1))))
+			break;
+	}
+
+	slot = &ew->ew_slots[l][(t >> (EVENT_WHEEL_BITS * l)) &
+	    EVENT_WHEEL_MASK];
+insert:
+	LIST_INSERT_HEAD(slot, ev, ev_timer.evt_wheel);
+}
+
+void
+event_wheel_insert(struct event_wheel *ew, struct event *ev)
+{
+	event_wheel_place(ew, ev);
+}
+
+void
+event_wheel_remove(struct event_wheel *ew, struct event *ev)
+{
+	LIST_REMOVE(ev, ev_timer.evt_wheel);
+}
+
+/*
+ * work out the next tick where something has to happen, either because
+ * an event on the bottom level expires or because an upper level slot
+ * needs to be cascaded down.
+ */
+static uint64_t
+event_wheel_next_tick(const struct event_wheel *ew)
+{
+	uint64_t cur, t, next = EVENT_WHEEL_NONE;
+	unsigned int l, k, shift;
+
+	for (l = 0; l < EVENT_WHEEL_LEVELS; l++) {
+		shift = EVENT_WHEEL_BITS * l;
+		cur = ew->ew_now >> shift;
+
+		for (k = 1; k <= EVENT_WHEEL_SLOTS; k++) {
+			if (LIST_EMPTY(&ew->ew_slots[l]
+			    [(cur + k) & EVENT_WHEEL_MASK]))
+				continue;
+
+			t = (cur + k) << shift;
+			if (t < next)
+				next = t;
+			break;
+		}
+	}
+
+	return (next);
+}
+
+static void
+event_wheel_cascade(struct event_wheel *ew, unsigned int l)
+{
+	struct event_wheel_slot *slot;
+	struct event *ev;
+	unsigned int s;
+
+	s = (ew->ew_now >> (EVENT_WHEEL_BITS * l)) & EVENT_WHEEL_MASK;
+	if (s == 0 && l + 1 < EVENT_WHEEL_LEVELS)
+		event_wheel_cascade(ew, l + 1);
+
+	slot = &ew->ew_slots[l][s];
+	while ((ev = LIST_FIRST(slot)) != NULL) {
+		LIST_REMOVE(ev, ev_timer.evt_wheel);
+		event_wheel_place(ew, ev);
+	}
+}
+
+static void
+event_wheel_advance(struct event_wheel *ew, uint64_t now)
+{
+	struct event_wheel_slot *slot;
+	struct event *ev;
+	uint64_t next;
+
+	while (ew->ew_now < now) {
+		/* skip over the ticks where nothing happens */
+		next = event_wheel_next_tick(ew);
+		if (next > now) {
+			ew->ew_now = now;
+			break;
+		}
+
+		ew->ew_now = next;
+		if ((next & EVENT_WHEEL_MASK) == 0)
+			event_wheel_cascade(ew, 1);
+
+		slot = &ew->ew_slots[0][next & EVENT_WHEEL_MASK];
+		while ((ev = LIST_FIRST(slot)) != NULL) {
+			LIST_REMOVE(ev, ev_timer.evt_wheel);
+			LIST_INSERT_HEAD(&ew->ew_expired, ev,
+			    ev_timer.evt_wheel);
+		}
+	}
+}
+
+struct event *
+event_wheel_cextract(struct event_wheel *ew, const struct timespec *now)
+{
+	struct event *ev;
+
+	event_wheel_advance(ew, event_wheel_ticks(ew, now, 0));
+
+	ev = LIST_FIRST(&ew->ew_expired);
+	if (ev != NULL)
+		LIST_REMOVE(ev, ev_timer.evt_wheel);
+
+	return (ev);
+}
+
+int
+event_wheel_next(const struct event_wheel *ew, struct timespec *deadline)
+{
+	uint64_t next;
+
+	if (!LIST_EMPTY(&ew->ew_expired))
+		next = ew->ew_now;
+	else {
+		next = event_wheel_next_tick(ew);
+		if (next == EVENT_WHEEL_NONE)
+			return (0);
+	}
+
+	event_wheel_ts(ew, next, deadline);
+
+	return (1);
+}
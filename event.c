@@ -21,184 +21,1038 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <string.h>
 #include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 
 #include "minevent.h"
 #include "minevent-internal.h"
 #include "heap.h"
+#if defined(EVENT_HEAP_DARY)
+#include "dheap.h"
+#endif
+
+#if defined(EVENT_HAS_EVENTFD)
+#include <sys/eventfd.h>
+#endif
 
 #define SET(_v, _m)	((_v) |= (_m))
 #define CLR(_v, _m)	((_v) &= ~(_m))
 #define ISSET(_v, _m)	((_v) & (_m))
 
-HEAP_HEAD(event_heap);
 TAILQ_HEAD(event_list, event);
+LIST_HEAD(event_timers, event);
+TAILQ_HEAD(event_common, event);
+
+/*
+ * common timeouts all have the same duration, so events added with
+ * one expire in the order they were added. they wait on a fifo, and
+ * only an event standing in for the head of the fifo goes in the heap.
+ *
+ * the timeval given out for a common timeout has a magic number and
+ * the index of the queue hidden in the top bits of tv_usec.
+ */
+#define EVENT_CTQ_USEC_MASK	0x000fffff
+#define EVENT_CTQ_IDX_MASK	0x0ff00000
+#define EVENT_CTQ_IDX_SHIFT	20
+#define EVENT_CTQ_MAGIC_MASK	0xf0000000
+#define EVENT_CTQ_MAGIC		0x50000000
+#define EVENT_CTQ_MAX		((EVENT_CTQ_IDX_MASK >> EVENT_CTQ_IDX_SHIFT) + 1)
+
+struct event_ctq {
+	struct event_common	 ectq_list;
+	struct event		 ectq_ev; /* in the heap for the head */
+	struct timeval		 ectq_duration;
+	struct timeval		 ectq_tv; /* the magic one */
+};
+
+static inline int
+event_deadline_compare(const struct timespec *a, const struct timespec *b)
+{
+	if (a->tv_sec > b->tv_sec)
+		return (1);
+	if (a->tv_sec < b->tv_sec)
+		return (-1);
+	if (a->tv_nsec > b->tv_nsec)
+		return (1);
+	if (a->tv_nsec < b->tv_nsec)
+		return (-1);
+
+	return (0);
+}
+
+#if defined(EVENT_HEAP_DARY)
+DHEAP_HEAD(event_heap, event, struct timespec);
+DHEAP_GENERATE(event_heap, event, ev_timer.evt_idx, ev_deadline,
+    event_deadline_compare);
+#else
+static inline int
+event_heap_compare(const struct event *a, const struct event *b)
+{
+	return (event_deadline_compare(&a->ev_deadline, &b->ev_deadline));
+}
 
-HEAP_PROTOTYPE(event_heap, event);
+HEAP_HEAD(event_heap);
+HEAP_GENERATE_INLINE(event_heap, event, ev_timer.evt_heap,
+    event_heap_compare);
+#endif
 
 struct event_base {
 	struct event_heap	 evb_heap; /* holds the timeouts */
+	struct event_wheel	*evb_wheel; /* or this does */
+	uint64_t		 evb_slack; /* nsec timeouts can be late by */
+	struct event_ctq	**evb_ctqs;
+	unsigned int		 evb_nctqs;
 	struct event_list	 evb_signals[NSIG];
+	struct event_siginfo	 evb_siginfo[NSIG];
 	struct event_list	 evb_list; /* holds fds */
 	unsigned int		 evb_list_len; /* number of fds */
 	unsigned int		 evb_nevents;
 	int			 evb_running;
-	struct event_list	 evb_fire;
+	int			 evb_loopexit;
+	struct event		 evb_loopexit_ev;
+
+	/* events ready to run, one queue per priority */
+	struct event_list	*evb_fire;
+	unsigned int		 evb_nfire;
+	struct event_list	 evb_fire_default;
+
+	/* the clock is read once per loop and cached while callbacks run */
+	clockid_t		 evb_monoclock;
+	clockid_t		 evb_wallclock;
+	struct timespec		 evb_monotime;
+	struct timespec		 evb_walltime;
+	int			 evb_monotime_cached;
+	int			 evb_walltime_cached;
 
 	const struct event_ops	*evb_ops;
 	void			*evb_backend;
+
+	/* event_active and event_base_wakeup from other threads */
+	struct event		*evb_async; /* lock-free stack */
+	unsigned int		 evb_async_notified;
+	int			 evb_async_fds[2];
+	struct event		 evb_async_ev;
+
+#if defined(EVENT_STATS)
+	struct event_stats	 evb_stats;
+#endif
 };
 
+#define EVENT_ASYNC_QUEUED	(1U << 31)
+
 #define event_op_init(_evb)						\
-	(*(_evb)->evb_ops->evo_init()
+	(*(_evb)->evb_ops->evo_init)()
 #define event_op_destroy(_evb, _backend)				\
-	(*(_evb)->evb_ops->evo_init)(_backend)
+	(*(_evb)->evb_ops->evo_destroy)(_backend)
 #define event_op_dispatch(_evb, _ts)					\
 	(*(_evb)->evb_ops->evo_dispatch)((_evb), (_ts))
 #define event_op_event_add(_evb, _ev)					\
-	(*(_evb)->evb_ops->evo_event_add)((_evb), (_ev))
+	(EVENT_STATS_INC((_evb), evs_backend_add),			\
+	    (*(_evb)->evb_ops->evo_event_add)((_evb), (_ev)))
 #define event_op_event_del(_evb, _ev)					\
-	(*(_evb)->evb_ops->evo_event_del)((_evb), (_ev))
+	(EVENT_STATS_INC((_evb), evs_backend_del),			\
+	    (*(_evb)->evb_ops->evo_event_del)((_evb), (_ev)))
+#define event_op_event_mod(_evb, _ev, _o)				\
+	(EVENT_STATS_INC((_evb), evs_backend_mod),			\
+	    (*(_evb)->evb_ops->evo_event_mod)((_evb), (_ev), (_o)))
 #define event_op_signal_add(_evb, _s)					\
-	(*(_evb)->evb_ops->evo_signal_add)((_evb), (_s))
+	(EVENT_STATS_INC((_evb), evs_backend_add),			\
+	    (*(_evb)->evb_ops->evo_signal_add)((_evb), (_s)))
 #define event_op_signal_del(_evb, _s)					\
-	(*(_evb)->evb_ops->evo_signal_del)((_evb), (_s))
+	(EVENT_STATS_INC((_evb), evs_backend_del),			\
+	    (*(_evb)->evb_ops->evo_signal_del)((_evb), (_s)))
 
-static int	event_deadline(struct timespec *, const struct timeval *);
+/*
+ * the counters cost a few clock reads per loop and per callback, so
+ * they only exist when asked for. without EVENT_STATS these are empty.
+ */
+#if defined(EVENT_STATS)
+static uint64_t	event_stats_nsec(void);
+static void	event_stats_hist(uint64_t *, uint64_t);
+static void	event_stats_lag(struct event_base *, const struct timespec *,
+		    const struct event *);
+static void	event_stats_fired(struct event_base *, short);
+
+#define EVENT_STATS_INC(_evb, _f)	((_evb)->evb_stats._f++)
+#define EVENT_STATS_STAMP(_t)		((_t) = event_stats_nsec())
+#define EVENT_STATS_WAIT(_evb, _t)					\
+	((_evb)->evb_stats.evs_wait_nsec += event_stats_nsec() - (_t))
+#define EVENT_STATS_CALLBACK(_evb, _t)					\
+	event_stats_hist((_evb)->evb_stats.evs_callback_nsec,		\
+	    event_stats_nsec() - (_t))
+#define EVENT_STATS_LAG(_evb, _now, _ev)				\
+	event_stats_lag((_evb), (_now), (_ev))
+#define EVENT_STATS_FIRED(_evb, _e)	event_stats_fired((_evb), (_e))
+#else
+#define EVENT_STATS_INC(_evb, _f)	((void)0)
+#define EVENT_STATS_STAMP(_t)		((void)0)
+#define EVENT_STATS_WAIT(_evb, _t)	((void)0)
+#define EVENT_STATS_CALLBACK(_evb, _t)	((void)0)
+#define EVENT_STATS_LAG(_evb, _now, _ev) ((void)0)
+#define EVENT_STATS_FIRED(_evb, _e)	((void)0)
+#endif
+
+static int	event_monotime(struct event_base *, struct timespec *);
+static int	event_walltime(struct event_base *, struct timespec *);
+static int	event_deadline(struct event_base *, struct timespec *,
+		    struct event_ctq **, const struct timeval *);
+static int	event_deadline_slack(struct event_base *, struct timespec *,
+		    struct event_ctq **, const struct timeval *, uint64_t);
+static struct event_ctq *
+		event_ctq_lookup(struct event_base *, const struct timeval *);
+static int	event_slack(const struct timeval *, uint64_t *);
+static void	evtimer_schedule(struct event *, const struct timespec *,
+		    struct event_ctq *);
+static void	event_remaining(struct event_base *, const struct event *,
+		    struct timeval *);
+static int	event_async_init(struct event_base *);
+static void	event_async_fini(struct event_base *);
+static void	event_async_cancel(struct event *);
+static void	event_async_del(struct event_base *, struct event *);
+static void	event_async_drain(struct event_base *);
+static void	event_loopexit_fire(int, short, void *);
 
+/*
+ * make sure event_timer_insert cant fail.
+ */
 static inline int
-event_heap_empty(struct event_base *evb)
+event_timer_reserve(struct event_base *evb)
 {
-	return (HEAP_EMPTY(event_heap, &evb->evb_heap));
+#if defined(EVENT_HEAP_DARY)
+	if (evb->evb_wheel == NULL)
+		return (DHEAP_RESERVE(event_heap, &evb->evb_heap, 1));
+#endif
+	return (0);
 }
 
 static inline void
-event_heap_insert(struct event_base *evb, struct event *ev,
+event_timer_insert(struct event_base *evb, struct event *ev,
     const struct timespec *deadline)
 {
 	ev->ev_deadline = *deadline;
-	HEAP_INSERT(event_heap, &evb->evb_heap, ev);
+	if (evb->evb_wheel != NULL)
+		event_wheel_insert(evb->evb_wheel, ev);
+	else
+		HEAP_INSERT(event_heap, &evb->evb_heap, ev);
+}
+
+static inline void
+event_timer_remove(struct event_base *evb, struct event *ev)
+{
+	if (evb->evb_wheel != NULL)
+		event_wheel_remove(evb->evb_wheel, ev);
+	else
+		HEAP_REMOVE(event_heap, &evb->evb_heap, ev);
+}
+
+/*
+ * put the event standing in for a common queue in the heap with the
+ * deadline of the event at the head of the queue.
+ */
+static void
+event_ctq_arm(struct event_base *evb, struct event_ctq *ctq)
+{
+	struct event *cev = &ctq->ectq_ev;
+	struct event *ev;
+
+	if (ISSET(cev->ev_event, EV_ON_HEAP)) {
+		event_timer_remove(evb, cev);
+		CLR(cev->ev_event, EV_ON_HEAP);
+	}
+
+	ev = TAILQ_FIRST(&ctq->ectq_list);
+	if (ev != NULL) {
+		event_timer_insert(evb, cev, &ev->ev_deadline);
+		SET(cev->ev_event, EV_ON_HEAP);
+	}
+}
+
+static inline void
+event_timeout_insert(struct event_base *evb, struct event *ev,
+    const struct timespec *deadline, struct event_ctq *ctq)
+{
+	unsigned int idx;
+
+	if (ctq == NULL) {
+		event_timer_insert(evb, ev, deadline);
+		return;
+	}
+
+	idx = (ctq->ectq_tv.tv_usec & EVENT_CTQ_IDX_MASK) >>
+	    EVENT_CTQ_IDX_SHIFT;
+
+	ev->ev_deadline = *deadline;
+	ev->ev_timer.evt_common.evtc_idx = idx;
+	TAILQ_INSERT_TAIL(&ctq->ectq_list, ev, ev_timer.evt_common.evtc_entry);
+	SET(ev->ev_event, EV_ON_COMMON);
+
+	if (TAILQ_FIRST(&ctq->ectq_list) == ev)
+		event_ctq_arm(evb, ctq);
 }
 
 static inline void
-event_heap_remove(struct event_base *evb, struct event *ev)
+event_timeout_remove(struct event_base *evb, struct event *ev)
+{
+	struct event_ctq *ctq;
+	int head;
+
+	if (!ISSET(ev->ev_event, EV_ON_COMMON)) {
+		event_timer_remove(evb, ev);
+		return;
+	}
+
+	ctq = evb->evb_ctqs[ev->ev_timer.evt_common.evtc_idx];
+	head = (TAILQ_FIRST(&ctq->ectq_list) == ev);
+	TAILQ_REMOVE(&ctq->ectq_list, ev, ev_timer.evt_common.evtc_entry);
+	CLR(ev->ev_event, EV_ON_COMMON);
+
+	if (head)
+		event_ctq_arm(evb, ctq);
+}
+
+/*
+ * move the events on a common queue that have expired onto the
+ * expired list. the heap gave up a slot for the queue's event, so
+ * it can go straight back in for the new head.
+ */
+static void
+event_ctq_expire(struct event_base *evb, struct event_ctq *ctq,
+    const struct event *now, struct event_timers *expired)
 {
-	HEAP_REMOVE(event_heap, &evb->evb_heap, ev);
+	struct event *ev;
+
+	while ((ev = TAILQ_FIRST(&ctq->ectq_list)) != NULL) {
+		if (timespeccmp(&ev->ev_deadline, &now->ev_deadline, >))
+			break;
+
+		/* EV_ON_COMMON stays set until the timeout is handled */
+		TAILQ_REMOVE(&ctq->ectq_list, ev,
+		    ev_timer.evt_common.evtc_entry);
+		LIST_INSERT_HEAD(expired, ev, ev_timer.evt_wheel);
+	}
+
+	event_ctq_arm(evb, ctq);
 }
 
-static inline struct event *
-event_heap_first(struct event_base *evb)
+static inline int
+event_timer_next(struct event_base *evb, struct timespec *deadline)
 {
-	return (HEAP_FIRST(event_heap, &evb->evb_heap));
+	struct event *ev;
+
+	if (evb->evb_wheel != NULL)
+		return (event_wheel_next(evb->evb_wheel, deadline));
+
+	ev = HEAP_FIRST(event_heap, &evb->evb_heap);
+	if (ev == NULL)
+		return (0);
+
+	*deadline = ev->ev_deadline;
+	return (1);
 }
 
-static inline struct event *
-event_heap_cextract(struct event_base *evb, const struct event *now)
+static void
+event_timer_expired(void *node, void *arg)
 {
-	return (HEAP_CEXTRACT(event_heap, &evb->evb_heap, now));
+	struct event_timers *expired = arg;
+	struct event *ev = node;
+
+	/* the heap is done with ev_timer once the event is out */
+	LIST_INSERT_HEAD(expired, ev, ev_timer.evt_wheel);
 }
 
-static inline struct event *
-event_fire_first(struct event_base *evb)
+/*
+ * merge sort the expired list by deadline. neither the heap nor the
+ * wheel give timeouts up in order when they're taken in a batch.
+ */
+static void
+event_timer_sort(struct event_timers *list)
+{
+	struct event_timers a = LIST_HEAD_INITIALIZER(a);
+	struct event_timers b = LIST_HEAD_INITIALIZER(b);
+	struct event_timers *half = &a;
+	struct event *ev, *tail = NULL;
+
+	ev = LIST_FIRST(list);
+	if (ev == NULL || LIST_NEXT(ev, ev_timer.evt_wheel) == NULL)
+		return;
+
+	while ((ev = LIST_FIRST(list)) != NULL) {
+		LIST_REMOVE(ev, ev_timer.evt_wheel);
+		LIST_INSERT_HEAD(half, ev, ev_timer.evt_wheel);
+		half = (half == &a) ? &b : &a;
+	}
+
+	event_timer_sort(&a);
+	event_timer_sort(&b);
+
+	for (;;) {
+		if (LIST_EMPTY(&a))
+			half = &b;
+		else if (LIST_EMPTY(&b))
+			half = &a;
+		else {
+			half = timespeccmp(&LIST_FIRST(&b)->ev_deadline,
+			    &LIST_FIRST(&a)->ev_deadline, <) ? &b : &a;
+		}
+
+		ev = LIST_FIRST(half);
+		if (ev == NULL)
+			break;
+
+		LIST_REMOVE(ev, ev_timer.evt_wheel);
+		if (tail == NULL)
+			LIST_INSERT_HEAD(list, ev, ev_timer.evt_wheel);
+		else
+			LIST_INSERT_AFTER(tail, ev, ev_timer.evt_wheel);
+		tail = ev;
+	}
+}
+
+/*
+ * move every timeout that has expired onto a list in one go, rather
+ * than fixing up the heap after each one. the events on expired common
+ * queues are added too, and the list is sorted so timeouts still fire
+ * in the order of their deadlines.
+ */
+static inline void
+event_timer_expire(struct event_base *evb, const struct event *now,
+    struct event_timers *expired)
+{
+	struct event *ev, *nev;
+
+	if (evb->evb_wheel == NULL) {
+		HEAP_EXTRACT_LE(event_heap, &evb->evb_heap, now,
+		    event_timer_expired, expired);
+	} else {
+		while ((ev = event_wheel_cextract(evb->evb_wheel,
+		    &now->ev_deadline)) != NULL)
+			event_timer_expired(ev, expired);
+	}
+
+	/* the queues put their events on the head, behind the walk */
+	for (ev = LIST_FIRST(expired); ev != NULL; ev = nev) {
+		nev = LIST_NEXT(ev, ev_timer.evt_wheel);
+		if (ISSET(ev->ev_event, EV_TYPE_MASK) != EV_COMMON)
+			continue;
+
+		LIST_REMOVE(ev, ev_timer.evt_wheel);
+		CLR(ev->ev_event, EV_ON_HEAP);
+		event_ctq_expire(evb, ev->ev_arg, now, expired);
+	}
+
+	event_timer_sort(expired);
+}
+
+/*
+ * put expired timeouts that weren't dealt with back.
+ */
+static void
+event_timer_restore(struct event_base *evb, struct event_timers *expired)
+{
+	struct event_timers rexpired = LIST_HEAD_INITIALIZER(rexpired);
+	struct event *ev;
+	struct event_ctq *ctq;
+
+	while ((ev = LIST_FIRST(expired)) != NULL) {
+		LIST_REMOVE(ev, ev_timer.evt_wheel);
+		LIST_INSERT_HEAD(&rexpired, ev, ev_timer.evt_wheel);
+	}
+
+	while ((ev = LIST_FIRST(&rexpired)) != NULL) {
+		LIST_REMOVE(ev, ev_timer.evt_wheel);
+		if (!ISSET(ev->ev_event, EV_ON_COMMON)) {
+			event_timer_insert(evb, ev, &ev->ev_deadline);
+			continue;
+		}
+
+		/* rexpired is backwards, so this puts them back in order */
+		ctq = evb->evb_ctqs[ev->ev_timer.evt_common.evtc_idx];
+		TAILQ_INSERT_HEAD(&ctq->ectq_list, ev,
+		    ev_timer.evt_common.evtc_entry);
+		event_ctq_arm(evb, ctq);
+	}
+}
+
+/*
+ * the fire queue with the lowest index has the highest priority.
+ */
+static inline struct event_list *
+event_fire_queue(struct event_base *evb)
+{
+	unsigned int i;
+
+	for (i = 0; i < evb->evb_nfire; i++) {
+		if (!TAILQ_EMPTY(&evb->evb_fire[i]))
+			return (&evb->evb_fire[i]);
+	}
+
+	return (NULL);
+}
+
+static inline struct event_list *
+event_fire_list(struct event_base *evb, const struct event *ev)
+{
+	unsigned int pri = ev->ev_pri;
+
+	/* events set up before the queues shrank use the last one */
+	if (pri >= evb->evb_nfire)
+		pri = evb->evb_nfire - 1;
+
+	return (&evb->evb_fire[pri]);
+}
+
+static inline void
+event_fire_insert(struct event_base *evb, struct event *ev)
+{
+	TAILQ_INSERT_TAIL(event_fire_list(evb, ev), ev, ev_fire);
+}
+
+static inline void
+event_fire_remove(struct event_base *evb, struct event *ev)
+{
+	TAILQ_REMOVE(event_fire_list(evb, ev), ev, ev_fire);
+}
+
+static struct event_base *_event_base = NULL;
+
+static inline int
+event_pri_default(const struct event_base *evb)
+{
+	/* the middle priority, like libevent */
+	return (evb == NULL ? 0 : evb->evb_nfire / 2);
+}
+
+struct event_base *
+event_init(void)
+{
+	struct event_base *evb;
+
+	evb = event_base_new();
+	if (evb == NULL)
+		return (NULL);
+
+	_event_base = evb;
+
+	return (evb);
+}
+
+struct event_base *
+event_base_new(void)
+{
+	const struct event_ops *ops = EVENT_OPS_DEFAULT;
+	struct event_base *evb;
+	void *backend;
+	int i;
+
+	evb = malloc(sizeof(*evb));
+	if (evb == NULL)
+		return (NULL);
+
+	backend = ops->evo_init();
+	if (backend == NULL) {
+		free(evb);
+		return (NULL);
+	}
+
+	HEAP_INIT(event_heap, &evb->evb_heap);
+	evb->evb_wheel = NULL;
+
+	for (i = 0; i < NSIG; i++) {
+		TAILQ_INIT(&evb->evb_signals[i]);
+		evb->evb_siginfo[i].esi_signo = 0;
+	}
+
+	TAILQ_INIT(&evb->evb_list);
+	evb->evb_list_len = 0;
+	evb->evb_nevents = 0;
+	TAILQ_INIT(&evb->evb_fire_default);
+	evb->evb_fire = &evb->evb_fire_default;
+	evb->evb_nfire = 1;
+
+	evb->evb_slack = 0;
+	evb->evb_ctqs = NULL;
+	evb->evb_nctqs = 0;
+
+	evb->evb_monoclock = CLOCK_MONOTONIC;
+	evb->evb_wallclock = CLOCK_REALTIME;
+	evb->evb_monotime_cached = 0;
+	evb->evb_walltime_cached = 0;
+
+	evb->evb_running = 0;
+	evb->evb_loopexit = 0;
+	evb->evb_ops = ops;
+#if defined(EVENT_STATS)
+	memset(&evb->evb_stats, 0, sizeof(evb->evb_stats));
+#endif
+	evb->evb_backend = backend;
+
+	evtimer_set(&evb->evb_loopexit_ev, event_loopexit_fire, evb);
+	event_base_set(evb, &evb->evb_loopexit_ev);
+
+	if (event_async_init(evb) == -1) {
+		event_op_destroy(evb, backend);
+		free(evb);
+		return (NULL);
+	}
+
+	return (evb);
+}
+
+void
+event_base_free(struct event_base *evb)
+{
+	unsigned int i;
+
+	if (evb == _event_base)
+		_event_base = NULL;
+
+	event_op_destroy(evb, evb->evb_backend);
+	event_async_fini(evb);
+	if (evb->evb_wheel != NULL)
+		event_wheel_destroy(evb->evb_wheel);
+#if defined(EVENT_HEAP_DARY)
+	DHEAP_DESTROY(event_heap, &evb->evb_heap);
+#endif
+	for (i = 0; i < evb->evb_nctqs; i++)
+		free(evb->evb_ctqs[i]);
+	free(evb->evb_ctqs);
+	if (evb->evb_fire != &evb->evb_fire_default)
+		free(evb->evb_fire);
+	free(evb);
+}
+
+int
+event_priority_init(int npri)
+{
+	return (event_base_priority_init(_event_base, npri));
+}
+
+int
+event_base_priority_init(struct event_base *evb, int npri)
+{
+	struct event_list *fire;
+	int i;
+
+	if (npri < 1 || npri > EVENT_MAX_PRIORITIES) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	if (event_fire_queue(evb) != NULL) {
+		/* events cannot be moved between queues */
+		errno = EBUSY;
+		return (-1);
+	}
+
+	if (npri == 1)
+		fire = &evb->evb_fire_default;
+	else {
+		fire = reallocarray(NULL, npri, sizeof(*fire));
+		if (fire == NULL)
+			return (-1);
+	}
+
+	for (i = 0; i < npri; i++)
+		TAILQ_INIT(&fire[i]);
+
+	if (evb->evb_fire != &evb->evb_fire_default)
+		free(evb->evb_fire);
+	evb->evb_fire = fire;
+	evb->evb_nfire = npri;
+
+	return (0);
+}
+
+int
+event_priority_set(struct event *ev, int pri)
+{
+	struct event_base *evb = ev->ev_base;
+
+	if (ISSET(ev->ev_event, EV_ON_FIRE)) {
+		errno = EBUSY;
+		return (-1);
+	}
+
+	if (pri < 0 || (unsigned int)pri >= evb->evb_nfire) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	ev->ev_pri = pri;
+
+	return (0);
+}
+
+int
+event_base_timer_wheel(struct event_base *evb, const struct timeval *tick)
+{
+	struct event_wheel *ew = NULL;
+	struct timespec ts, now;
+
+	if (!HEAP_EMPTY(event_heap, &evb->evb_heap) ||
+	    (evb->evb_wheel != NULL &&
+	     event_wheel_next(evb->evb_wheel, &ts))) {
+		/* timeouts cannot be moved between stores */
+		errno = EBUSY;
+		return (-1);
+	}
+
+	if (tick != NULL) {
+		if (event_monotime(evb, &now) == -1)
+			return (-1);
+
+		TIMEVAL_TO_TIMESPEC(tick, &ts);
+		ew = event_wheel_create(&ts, &now);
+		if (ew == NULL)
+			return (-1);
+	}
+
+	if (evb->evb_wheel != NULL)
+		event_wheel_destroy(evb->evb_wheel);
+	evb->evb_wheel = ew;
+
+	return (0);
+}
+
+int
+event_base_timer_slack(struct event_base *evb, const struct timeval *slack)
+{
+	return (event_slack(slack, &evb->evb_slack));
+}
+
+static struct event_ctq *
+event_ctq_lookup(struct event_base *evb, const struct timeval *tv)
+{
+	struct event_ctq *ctq;
+	unsigned int idx;
+
+	idx = (tv->tv_usec & EVENT_CTQ_IDX_MASK) >> EVENT_CTQ_IDX_SHIFT;
+	if (idx < evb->evb_nctqs) {
+		ctq = evb->evb_ctqs[idx];
+		if (ctq->ectq_tv.tv_sec == tv->tv_sec &&
+		    ctq->ectq_tv.tv_usec == tv->tv_usec)
+			return (ctq);
+	}
+
+	/* it's from another base or has been made up */
+	errno = EINVAL;
+	return (NULL);
+}
+
+const struct timeval *
+event_base_init_common_timeout(struct event_base *evb,
+    const struct timeval *tv)
+{
+	struct event_ctq **ctqs, *ctq;
+	struct event *cev;
+	unsigned int i;
+
+	if (ISSET(tv->tv_usec, EVENT_CTQ_MAGIC_MASK) == EVENT_CTQ_MAGIC) {
+		ctq = event_ctq_lookup(evb, tv);
+		return (ctq == NULL ? NULL : &ctq->ectq_tv);
+	}
+
+	if (tv->tv_sec < 0 || tv->tv_usec < 0 || tv->tv_usec >= 1000000) {
+		errno = EINVAL;
+		return (NULL);
+	}
+
+	for (i = 0; i < evb->evb_nctqs; i++) {
+		ctq = evb->evb_ctqs[i];
+		if (timercmp(&ctq->ectq_duration, tv, ==))
+			return (&ctq->ectq_tv);
+	}
+
+	if (i >= EVENT_CTQ_MAX) {
+		errno = ENOSPC;
+		return (NULL);
+	}
+
+	ctqs = reallocarray(evb->evb_ctqs, i + 1, sizeof(*ctqs));
+	if (ctqs == NULL)
+		return (NULL);
+	evb->evb_ctqs = ctqs;
+
+	ctq = malloc(sizeof(*ctq));
+	if (ctq == NULL)
+		return (NULL);
+
+	TAILQ_INIT(&ctq->ectq_list);
+	ctq->ectq_duration = *tv;
+	ctq->ectq_tv.tv_sec = tv->tv_sec;
+	ctq->ectq_tv.tv_usec = tv->tv_usec | EVENT_CTQ_MAGIC |
+	    (i << EVENT_CTQ_IDX_SHIFT);
+
+	/* this never runs, the loop takes the queue's events instead */
+	cev = &ctq->ectq_ev;
+	cev->ev_cookie = NULL;
+	cev->ev_base = evb;
+	cev->ev_pri = 0;
+	cev->ev_ident = -1;
+	cev->ev_fn = NULL;
+	cev->ev_arg = ctq;
+	cev->ev_event = EV_INITIALIZED | EV_COMMON;
+	cev->ev_fires = 0;
+	cev->ev_async_next = NULL;
+	cev->ev_async = 0;
+
+	ctqs[i] = ctq;
+	evb->evb_nctqs = i + 1;
+
+	return (&ctq->ectq_tv);
+}
+
+int
+event_base_coarse_clock(struct event_base *evb, int on)
+{
+#if defined(EVENT_HAS_CLOCK_COARSE)
+	/* the coarse clocks count from the same epoch as the precise ones */
+	evb->evb_monoclock = on ? CLOCK_MONOTONIC_COARSE : CLOCK_MONOTONIC;
+	evb->evb_wallclock = on ? CLOCK_REALTIME_COARSE : CLOCK_REALTIME;
+
+	return (0);
+#else
+	if (!on)
+		return (0);
+
+	errno = EOPNOTSUPP;
+	return (-1);
+#endif
+}
+
+int
+event_base_gettimeofday_cached(struct event_base *evb, struct timeval *tv)
+{
+	struct timespec now;
+
+	if (evb == NULL) {
+		evb = _event_base;
+		if (evb == NULL)
+			return (gettimeofday(tv, NULL));
+	}
+
+	if (event_walltime(evb, &now) == -1)
+		return (-1);
+
+	TIMESPEC_TO_TIMEVAL(tv, &now);
+
+	return (0);
+}
+
+int
+event_base_get_stats(struct event_base *evb, struct event_stats *evs)
+{
+#if defined(EVENT_STATS)
+	*evs = evb->evb_stats;
+	return (0);
+#else
+	errno = EOPNOTSUPP;
+	return (-1);
+#endif
+}
+
+#if defined(EVENT_STATS)
+static uint64_t
+event_stats_nsec(void)
+{
+	struct timespec ts;
+
+	/* the coarse clock is no good for timing callbacks */
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		return (0);
+
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static void
+event_stats_hist(uint64_t *buckets, uint64_t nsec)
+{
+	unsigned int b = 0;
+
+	while (nsec != 0 && b < EVENT_STATS_BUCKETS - 1) {
+		nsec >>= 1;
+		b++;
+	}
+
+	buckets[b]++;
+}
+
+static void
+event_stats_lag(struct event_base *evb, const struct timespec *now,
+    const struct event *ev)
+{
+	struct timespec lag;
+
+	if (timespeccmp(now, &ev->ev_deadline, >))
+		timespecsub(now, &ev->ev_deadline, &lag);
+	else
+		timespecclear(&lag);
+
+	event_stats_hist(evb->evb_stats.evs_lag_nsec,
+	    (uint64_t)lag.tv_sec * 1000000000ULL + lag.tv_nsec);
+}
+
+static void
+event_stats_fired(struct event_base *evb, short event)
+{
+	evb->evb_stats.evs_callbacks++;
+
+	if (ISSET(event, EV_READ|EV_WRITE))
+		evb->evb_stats.evs_fired_io++;
+	if (ISSET(event, EV_TIMEOUT))
+		evb->evb_stats.evs_fired_timeout++;
+	if (ISSET(event, EV_SIGNAL))
+		evb->evb_stats.evs_fired_signal++;
+}
+#endif /* EVENT_STATS */
+
+int
+event_base_set(struct event_base *evb, struct event *ev)
+{
+	if (ISSET(ev->ev_event, EV_ON_LIST|EV_ON_HEAP|EV_ON_FIRE)) {
+		errno = EBUSY;
+		return (-1);
+	}
+
+	ev->ev_base = evb;
+	ev->ev_pri = event_pri_default(evb);
+
+	return (0);
+}
+
+int
+event_dispatch(void)
+{
+	return (event_base_loop(_event_base, 0));
+}
+
+int
+event_loop(int flags)
+{
+	return (event_base_loop(_event_base, flags));
+}
+
+int
+event_loopexit(const struct timeval *tv)
 {
-	return (TAILQ_FIRST(&evb->evb_fire));
+	return (event_base_loopexit(_event_base, tv));
 }
 
-static inline void
-event_fire_insert(struct event_base *evb, struct event *ev)
+int
+event_loopbreak(void)
 {
-	TAILQ_INSERT_TAIL(&evb->evb_fire, ev, ev_fire);
+	return (event_base_loopbreak(_event_base));
 }
 
-static inline void
-event_fire_remove(struct event_base *evb, struct event *ev)
+int
+event_base_dispatch(struct event_base *evb)
 {
-	TAILQ_REMOVE(&evb->evb_fire, ev, ev_fire);
+	return (event_base_loop(evb, 0));
 }
 
-static struct event_base *_event_base = NULL;
-
-#include <unistd.h>
-
-struct event_base *
-event_init(void)
+int
+event_base_loopexit(struct event_base *evb, const struct timeval *tv)
 {
-	const struct event_ops *ops = EVENT_OPS_DEFAULT;
-	struct event_base *evb;
-	void *backend;
-	int i;
-
-	evb = malloc(sizeof(*evb));
-	if (evb == NULL)
-		return (NULL);
-
-	backend = ops->evo_init();
-	if (backend == NULL) {
-		free(evb);
-		return (NULL);
-	}
-
-	HEAP_INIT(event_heap, &evb->evb_heap);
+	struct timeval now = { 0, 0 };
 
-	for (i = 0; i < NSIG; i++)
-		TAILQ_INIT(&evb->evb_signals[i]);
+	/* use a timeout so the loop finishes running the current events */
+	if (tv == NULL)
+		tv = &now;
 
-	TAILQ_INIT(&evb->evb_list);
-	evb->evb_list_len = 0;
-	evb->evb_nevents = 0;
-	TAILQ_INIT(&evb->evb_fire);
+	return (evtimer_add(&evb->evb_loopexit_ev, tv));
+}
 
+int
+event_base_loopbreak(struct event_base *evb)
+{
 	evb->evb_running = 0;
-	evb->evb_ops = ops;
-	evb->evb_backend = backend;
 
-	_event_base = evb;
+	return (0);
+}
 
-	return (evb);
+static void
+event_loopexit_fire(int nil, short events, void *arg)
+{
+	struct event_base *evb = arg;
+
+	evb->evb_loopexit = 1;
 }
 
 int
-event_dispatch(void)
+event_base_loop(struct event_base *evb, int flags)
 {
-	struct event_base *evb = _event_base;
+	struct event_list *evl;
+	struct event_timers expired = LIST_HEAD_INITIALIZER(expired);
 	struct event *ev;
 	struct event now;
-	struct timespec *ts;
+	struct timespec deadline, *ts;
 	short event;
-	int runs = 0;
+	int rv = 0;
+	int polled = 0;
+	unsigned int ran;
+#if defined(EVENT_STATS)
+	uint64_t stamp;
+#endif
+
+	if (ISSET(flags,
+	    ~(EVLOOP_ONCE|EVLOOP_NONBLOCK|EVLOOP_NO_EXIT_ON_EMPTY))) {
+		errno = EINVAL;
+		return (-1);
+	}
 
 	evb->evb_running = 1;
+	evb->evb_loopexit = 0;
 	for (;;) {
-		if (++runs == 30)
-			abort();
+		EVENT_STATS_INC(evb, evs_loops);
 
-		if (event_monotime(&now.ev_deadline) == -1)
-			return (-1);
+		if (event_monotime(evb, &now.ev_deadline) == -1) {
+			rv = -1;
+			break;
+		}
 
-		while ((ev = event_heap_cextract(evb, &now)) != NULL) {
-			struct event_list *evl;
+		/* callbacks that add timeouts reuse this time */
+		evb->evb_monotime = now.ev_deadline;
+		evb->evb_monotime_cached = 1;
+		evb->evb_walltime_cached = 0;
 
+		event_timer_expire(evb, &now, &expired);
+		while ((ev = LIST_FIRST(&expired)) != NULL) {
 			switch (ISSET(ev->ev_event, EV_TYPE_MASK)) {
 			case EV_IO:
-				if (event_op_event_del(evb, ev) != 0)
-					return (-1);
+				if (event_op_event_del(evb, ev) != 0) {
+					event_timer_restore(evb, &expired);
+					rv = -1;
+					goto out;
+				}
 
 				event_list_remove(evb, ev);
 				break;
 			case EV_SIGNAL:
 				evl = &evb->evb_signals[ev->ev_ident];
 				TAILQ_REMOVE(evl, ev, ev_list);
-				if (TAILQ_EMPTY(evl) &&
-				    event_op_signal_del(evb, ev->ev_ident) != 0)
-					return (-1);
+				if (!TAILQ_EMPTY(evl))
+					break;
+				if (event_op_signal_del(evb,
+				    ev->ev_ident) != 0) {
+					TAILQ_INSERT_TAIL(evl, ev, ev_list);
+					event_timer_restore(evb, &expired);
+					rv = -1;
+					goto out;
+				}
 				break;
 			case EV_TIMEOUT:
 				break;
 			default:
 				abort();
 			}
-			CLR(ev->ev_event, EV_ON_LIST|EV_ON_HEAP);
+			LIST_REMOVE(ev, ev_timer.evt_wheel);
+			CLR(ev->ev_event, EV_ON_LIST|EV_ON_HEAP|EV_ON_COMMON);
 			evb->evb_nevents--;
+			EVENT_STATS_LAG(evb, &now.ev_deadline, ev);
 
 			SET(ev->ev_fires, EV_TIMEOUT);
 			if (!ISSET(ev->ev_event, EV_ON_FIRE)) {
@@ -207,32 +1061,71 @@ event_dispatch(void)
 			}
 		}
 
-		while ((ev = event_fire_first(evb)) != NULL) {
-			event_fire_remove(evb, ev);
+		/*
+		 * only run the highest priority events, and poll again
+		 * before the lower priority events get a go.
+		 */
+		ran = 0;
+		evl = event_fire_queue(evb);
+		while (evl != NULL && (ev = TAILQ_FIRST(evl)) != NULL) {
+			TAILQ_REMOVE(evl, ev, ev_fire);
 			CLR(ev->ev_event, EV_ON_FIRE);
 			event = ev->ev_fires;
 			ev->ev_fires = 0;
 
+			EVENT_STATS_FIRED(evb, event);
+			EVENT_STATS_STAMP(stamp);
 			(*ev->ev_fn)(ev->ev_ident, event, ev->ev_arg);
+			EVENT_STATS_CALLBACK(evb, stamp);
 			if (!evb->evb_running)
-				return (0);
+				goto out;
+			ran++;
 		}
+		evl = event_fire_queue(evb);
+
+		if (evb->evb_loopexit)
+			break;
+		if (ISSET(flags, EVLOOP_ONCE) && ran > 0)
+			break;
+		if (ISSET(flags, EVLOOP_NONBLOCK) && polled)
+			break;
 
-		if (evb->evb_nevents == 0)
+		/* events handed over by event_active still have to run */
+		if (evb->evb_nevents == 0 && evl == NULL &&
+		    __atomic_load_n(&evb->evb_async, __ATOMIC_ACQUIRE) ==
+		    NULL && !ISSET(flags, EVLOOP_NO_EXIT_ON_EMPTY))
 			break;
 
-		ev = event_heap_first(evb);
-		if (ev != NULL) {
-			ts = &now.ev_deadline;
-			timespecsub(&ev->ev_deadline, ts, ts);
+		/* time moves on while we sleep */
+		evb->evb_monotime_cached = 0;
+		evb->evb_walltime_cached = 0;
+
+		ts = &now.ev_deadline;
+		if (ISSET(flags, EVLOOP_NONBLOCK) || evl != NULL)
+			timespecclear(ts);
+		else if (event_timer_next(evb, &deadline)) {
+			if (timespeccmp(&deadline, ts, >))
+				timespecsub(&deadline, ts, ts);
+			else
+				timespecclear(ts);
 		} else
 			ts = NULL;
 
-		if (event_op_dispatch(evb, ts) == -1)
-			return (-1);
+		EVENT_STATS_STAMP(stamp);
+		if (event_op_dispatch(evb, ts) == -1) {
+			rv = -1;
+			break;
+		}
+		EVENT_STATS_WAIT(evb, stamp);
+		polled = 1;
 	}
 
-	return (0);
+out:
+	evb->evb_running = 0;
+	evb->evb_monotime_cached = 0;
+	evb->evb_walltime_cached = 0;
+
+	return (rv);
 }
 
 void
@@ -240,24 +1133,29 @@ event_set(struct event *ev, int fd, short events,
     void (*fn)(int, short, void *), void *arg)
 {
 	ev->ev_base = _event_base;
+	ev->ev_pri = event_pri_default(_event_base);
 	ev->ev_ident = fd;
 	ev->ev_fn = fn;
 	ev->ev_arg = arg;
 	ev->ev_event = EV_INITIALIZED | EV_IO |
-	    (events & (EV_READ|EV_WRITE|EV_PERSIST));
+	    (events & (EV_READ|EV_WRITE|EV_PERSIST|EV_ET|EV_EXCLUSIVE));
 	ev->ev_fires = 0;
+	ev->ev_async_next = NULL;
+	ev->ev_async = 0;
 }
 
 int
 event_add(struct event *ev, const struct timeval *tv)
 {
-	struct event_base *evb = _event_base;
+	struct event_base *evb = ev->ev_base;
 	struct timespec deadline;
+	struct event_ctq *ctq = NULL;
 	int flags = EV_ON_LIST;
-	int rv;
+	int rv = 0;
 
 	if (tv != NULL) {
-		if (event_deadline(&deadline, tv) == -1)
+		if (event_deadline(evb, &deadline, &ctq, tv) == -1 ||
+		    event_timer_reserve(evb) == -1)
 			return (-1);
 
 		flags |= EV_ON_HEAP;
@@ -271,11 +1169,11 @@ event_add(struct event *ev, const struct timeval *tv)
 		event_list_insert(evb, ev);
 		evb->evb_nevents++;
 	} else if (ISSET(ev->ev_event, EV_ON_HEAP))
-		event_heap_remove(evb, ev);
+		event_timeout_remove(evb, ev);
 
 	SET(ev->ev_event, flags);
 	if (tv != NULL)
-		event_heap_insert(evb, ev, &deadline);
+		event_timeout_insert(evb, ev, &deadline, ctq);
 
 	return (rv);
 }
@@ -283,7 +1181,7 @@ event_add(struct event *ev, const struct timeval *tv)
 int
 event_del(struct event *ev)
 {
-	struct event_base *evb = _event_base;
+	struct event_base *evb = ev->ev_base;
 	int rv;
 
 	if (ISSET(ev->ev_event, EV_ON_LIST)) {
@@ -295,12 +1193,60 @@ event_del(struct event *ev)
 	}
 
 	if (ISSET(ev->ev_event, EV_ON_HEAP))
-		event_heap_remove(evb, ev);
+		event_timeout_remove(evb, ev);
 
 	if (ISSET(ev->ev_event, EV_ON_FIRE))
 		event_fire_remove(evb, ev);
 
 	CLR(ev->ev_event, EV_ON_LIST|EV_ON_HEAP|EV_ON_FIRE);
+	event_async_del(evb, ev);
+
+	return (0);
+}
+
+/*
+ * change the interest set of an io event. if the event is pending the
+ * backend is told about the difference instead of going through a del
+ * and an add. the backend sees the new flags in ev_event and is given
+ * the old ones.
+ */
+int
+event_modify(struct event *ev, short events)
+{
+	struct event_base *evb = ev->ev_base;
+	short mask = EV_READ|EV_WRITE|EV_PERSIST|EV_ET;
+	short oevents = ev->ev_event;
+	short nevents;
+
+	if (ISSET(oevents, EV_TYPE_MASK) != EV_IO) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	nevents = (oevents & ~mask) | (events & mask);
+	if (nevents == oevents)
+		return (0);
+
+	if (!ISSET(oevents, EV_ON_LIST)) {
+		ev->ev_event = nevents;
+		return (0);
+	}
+
+	/*
+	 * a pending io event has to be waiting for something, and not
+	 * every backend can switch between edge and level triggers.
+	 */
+	if (!ISSET(nevents, EV_READ|EV_WRITE) ||
+	    ISSET(nevents ^ oevents, EV_ET)) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	ev->ev_event = nevents;
+	if (event_op_event_mod(evb, ev, oevents) != 0) {
+		ev->ev_event = oevents;
+		return (-1);
+	}
 
 	return (0);
 }
@@ -322,16 +1268,8 @@ event_pending(struct event *ev, short events, struct timeval *tv)
 	flags &= events;
 
 	if (ISSET(events, EV_TIMEOUT) && ISSET(flags, EV_ON_HEAP)) {
-		if (tv != NULL) {
-			struct timespec now, ts;
-
-			(void)event_monotime(&now);
-			timespecsub(&ev->ev_deadline, &now, &ts);
-			(void)event_walltime(&now);
-			timespecadd(&now, &ts, &ts);
-
-			TIMESPEC_TO_TIMEVAL(tv, &ts);
-		}
+		if (tv != NULL)
+			event_remaining(ev->ev_base, ev, tv);
 
 		flags |= EV_TIMEOUT;
 	}
@@ -344,29 +1282,62 @@ evtimer_set(struct event *ev,
     void (*fn)(int, short, void *), void *arg)
 {
 	ev->ev_base = _event_base;
+	ev->ev_pri = event_pri_default(_event_base);
 	ev->ev_ident = -1;
 	ev->ev_fn = fn;
 	ev->ev_arg = arg;
 	ev->ev_event = EV_INITIALIZED | EV_TIMEOUT;
 	ev->ev_fires = 0;
+	ev->ev_async_next = NULL;
+	ev->ev_async = 0;
+}
+
+static void
+evtimer_schedule(struct event *ev, const struct timespec *deadline,
+    struct event_ctq *ctq)
+{
+	struct event_base *evb = ev->ev_base;
+
+	if (!ISSET(ev->ev_event, EV_ON_HEAP)) {
+		evb->evb_nevents++;
+		SET(ev->ev_event, EV_ON_HEAP);
+	} else
+		event_timeout_remove(evb, ev);
+
+	event_timeout_insert(evb, ev, deadline, ctq);
 }
 
 int
 evtimer_add(struct event *ev, const struct timeval *tv)
 {
-	struct event_base *evb = _event_base;
+	struct event_base *evb = ev->ev_base;
 	struct timespec deadline;
+	struct event_ctq *ctq = NULL;
 
-	if (event_deadline(&deadline, tv) == -1)
+	if (event_deadline(evb, &deadline, &ctq, tv) == -1 ||
+	    event_timer_reserve(evb) == -1)
 		return (-1);
 
-	if (!ISSET(ev->ev_event, EV_ON_HEAP)) {
-		evb->evb_nevents++;
-		SET(ev->ev_event, EV_ON_HEAP);
-	} else
-		event_heap_remove(evb, ev);
+	evtimer_schedule(ev, &deadline, ctq);
+
+	return (0);
+}
 
-	event_heap_insert(evb, ev, &deadline);
+int
+evtimer_add_slack(struct event *ev, const struct timeval *tv,
+    const struct timeval *slack)
+{
+	struct event_base *evb = ev->ev_base;
+	struct timespec deadline;
+	struct event_ctq *ctq = NULL;
+	uint64_t nsec;
+
+	if (event_slack(slack, &nsec) == -1 ||
+	    event_deadline_slack(evb, &deadline, &ctq, tv, nsec) == -1 ||
+	    event_timer_reserve(evb) == -1)
+		return (-1);
+
+	evtimer_schedule(ev, &deadline, ctq);
 
 	return (0);
 }
@@ -374,14 +1345,18 @@ evtimer_add(struct event *ev, const struct timeval *tv)
 int
 evtimer_del(struct event *ev)
 {
-	struct event_base *evb = _event_base;
+	struct event_base *evb = ev->ev_base;
+
+	event_async_del(evb, ev);
 
 	if (!ISSET(ev->ev_event, EV_ON_HEAP|EV_ON_FIRE))
 		return (0);
 
-	evb->evb_nevents--;
-	if (ISSET(ev->ev_event, EV_ON_HEAP))
-		event_heap_remove(evb, ev);
+	/* only timers waiting on the heap are counted */
+	if (ISSET(ev->ev_event, EV_ON_HEAP)) {
+		event_timeout_remove(evb, ev);
+		evb->evb_nevents--;
+	}
 	if (ISSET(ev->ev_event, EV_ON_FIRE))
 		event_fire_remove(evb, ev);
 	CLR(ev->ev_event, EV_ON_HEAP | EV_ON_FIRE);
@@ -395,16 +1370,8 @@ evtimer_pending(struct event *ev, struct timeval *tv)
 	int flags = 0;
 
 	if (ISSET(ev->ev_event, EV_ON_HEAP)) {
-		if (tv != NULL) {
-			struct timespec now, ts;
-
-			(void)event_monotime(&now);
-			timespecsub(&ev->ev_deadline, &now, &ts);
-			(void)event_walltime(&now);
-			timespecadd(&now, &ts, &ts);
-
-			TIMESPEC_TO_TIMEVAL(tv, &ts);
-		}
+		if (tv != NULL)
+			event_remaining(ev->ev_base, ev, tv);
 
 		flags = EV_TIMEOUT | (ev->ev_event & EV_PERSIST);
 	}
@@ -425,23 +1392,28 @@ signal_set(struct event *ev, int signal,
 	assert(signal < NSIG);
 
 	ev->ev_base = _event_base;
+	ev->ev_pri = event_pri_default(_event_base);
 	ev->ev_ident = signal;
 	ev->ev_fn = fn;
 	ev->ev_arg = arg;
 	ev->ev_event = EV_INITIALIZED | EV_SIGNAL | EV_PERSIST;
 	ev->ev_fires = 0;
+	ev->ev_async_next = NULL;
+	ev->ev_async = 0;
 }
 
 int
 signal_add(struct event *ev, const struct timeval *tv)
 {
-	struct event_base *evb = _event_base;
+	struct event_base *evb = ev->ev_base;
 	struct timespec deadline;
+	struct event_ctq *ctq = NULL;
 	int flags = EV_ON_LIST;
 	int rv;
 
 	if (tv != NULL) {
-		if (event_deadline(&deadline, tv) == -1)
+		if (event_deadline(evb, &deadline, &ctq, tv) == -1 ||
+		    event_timer_reserve(evb) == -1)
 			return (-1);
 
 		flags |= EV_ON_HEAP;
@@ -460,11 +1432,11 @@ signal_add(struct event *ev, const struct timeval *tv)
 		TAILQ_INSERT_TAIL(evl, ev, ev_list);
 		evb->evb_nevents++;
 	} else if (ISSET(ev->ev_event, EV_ON_HEAP))
-		event_heap_remove(evb, ev);
+		event_timeout_remove(evb, ev);
 
 	SET(ev->ev_event, flags);
 	if (tv != NULL)
-		event_heap_insert(evb, ev, &deadline);
+		event_timeout_insert(evb, ev, &deadline, ctq);
 
 	return (0);
 }
@@ -472,7 +1444,9 @@ signal_add(struct event *ev, const struct timeval *tv)
 int
 signal_del(struct event *ev)
 {
-	struct event_base *evb = _event_base;
+	struct event_base *evb = ev->ev_base;
+
+	event_async_del(evb, ev);
 
 	if (!ISSET(ev->ev_event, EV_ON_LIST|EV_ON_FIRE))
 		return (0);
@@ -493,7 +1467,7 @@ signal_del(struct event *ev)
 	}
 
 	if (ISSET(ev->ev_event, EV_ON_HEAP))
-		event_heap_remove(evb, ev);
+		event_timeout_remove(evb, ev);
 
 	if (ISSET(ev->ev_event, EV_ON_FIRE))
 		event_fire_remove(evb, ev);
@@ -515,6 +1489,23 @@ signal_initialized(struct event *ev)
 	return (ISSET(ev->ev_event, EV_INITIALIZED));
 }
 
+int
+signal_siginfo(struct event *ev, struct event_siginfo *esi)
+{
+	struct event_base *evb = ev->ev_base;
+	const struct event_siginfo *sesi = &evb->evb_siginfo[ev->ev_ident];
+
+	if (sesi->esi_signo == 0) {
+		/* the backend doesn't know, or the signal hasn't fired */
+		errno = ENOENT;
+		return (-1);
+	}
+
+	*esi = *sesi;
+
+	return (0);
+}
+
 void
 event_fire_event(struct event_base *evb, struct event *ev, short event)
 {
@@ -533,7 +1524,7 @@ event_fire_event(struct event_base *evb, struct event *ev, short event)
 		}
 
 		if (ISSET(ev->ev_event, EV_ON_HEAP))
-			event_heap_remove(evb, ev);
+			event_timeout_remove(evb, ev);
 
 		event_list_remove(evb, ev);
 		evb->evb_nevents--;
@@ -545,6 +1536,14 @@ event_fire_event(struct event_base *evb, struct event *ev, short event)
 	event_fire_insert(evb, ev);
 }
 
+void
+event_set_siginfo(struct event_base *evb, const struct event_siginfo *esi)
+{
+	assert(esi->esi_signo < NSIG);
+
+	evb->evb_siginfo[esi->esi_signo] = *esi;
+}
+
 void
 event_fire_signal(struct event_base *evb, int sig)
 {
@@ -564,36 +1563,307 @@ event_fire_signal(struct event_base *evb, int sig)
 	}
 }
 
+/*
+ * event_active and event_base_wakeup may be called from other threads.
+ * events are pushed onto a lock-free stack on the base and the loop is
+ * woken up by making an eventfd (or a pipe) readable. the handler for
+ * that fd runs in the loop and moves the events onto the fire list.
+ *
+ * ev_async holds the pending res flags, and EVENT_ASYNC_QUEUED while
+ * the event is on the stack, so an event is only pushed once no matter
+ * how many threads activate it.
+ *
+ * the setters reset ev_async without looking at it because the event
+ * may be uninitialised memory, so an event that has been activated has
+ * to be deleted before it is set again. resetting it while it is still
+ * on the stack would cut off the events linked after it.
+ */
+
+void
+event_active(struct event *ev, int res)
+{
+	struct event_base *evb = ev->ev_base;
+	struct event *head;
+
+	if (__atomic_fetch_or(&ev->ev_async, EVENT_ASYNC_QUEUED |
+	    (res & (EV_TIMEOUT|EV_SIGNAL|EV_READ|EV_WRITE)),
+	    __ATOMIC_ACQ_REL) != 0) {
+		/* someone else already pushed it */
+		return;
+	}
+
+	head = __atomic_load_n(&evb->evb_async, __ATOMIC_RELAXED);
+	do {
+		ev->ev_async_next = head;
+	} while (!__atomic_compare_exchange_n(&evb->evb_async, &head, ev,
+	    1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	event_base_wakeup(evb);
+}
+
+int
+event_base_wakeup(struct event_base *evb)
+{
+#if defined(EVENT_HAS_EVENTFD)
+	uint64_t one = 1;
+#else
+	char one = 1;
+#endif
+
+	if (__atomic_exchange_n(&evb->evb_async_notified, 1,
+	    __ATOMIC_ACQ_REL) != 0) {
+		/* the loop hasn't seen the last wakeup yet */
+		return (0);
+	}
+
+	if (write(evb->evb_async_fds[1], &one, sizeof(one)) == -1 &&
+	    errno != EAGAIN) {
+		/* the loop wasn't told, so let the next caller try */
+		__atomic_store_n(&evb->evb_async_notified, 0,
+		    __ATOMIC_RELEASE);
+		return (-1);
+	}
+
+	return (0);
+}
+
+static void
+event_async_read(int fd, short events, void *arg)
+{
+	struct event_base *evb = arg;
+	char buf[64];
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		continue;
+
+	/*
+	 * anything pushed after this point will notify us again, and
+	 * anything pushed before it is picked up below.
+	 */
+	__atomic_store_n(&evb->evb_async_notified, 0, __ATOMIC_SEQ_CST);
+	event_async_drain(evb);
+}
+
+/*
+ * move everything on the stack onto the fire list. this runs in the
+ * loop, or in event_del on the thread that owns the loop.
+ */
+static void
+event_async_drain(struct event_base *evb)
+{
+	struct event *ev, *nev, *list = NULL;
+	unsigned int res;
+
+	ev = __atomic_exchange_n(&evb->evb_async, NULL, __ATOMIC_SEQ_CST);
+
+	/* the stack gives us the newest first, put them back in order */
+	while (ev != NULL) {
+		nev = ev->ev_async_next;
+		ev->ev_async_next = list;
+		list = ev;
+		ev = nev;
+	}
+
+	for (ev = list; ev != NULL; ev = nev) {
+		/* another thread may push ev again after this */
+		nev = ev->ev_async_next;
+		res = __atomic_exchange_n(&ev->ev_async, 0, __ATOMIC_ACQ_REL);
+		CLR(res, EVENT_ASYNC_QUEUED);
+		if (res == 0) {
+			/* event_del got in first */
+			continue;
+		}
+
+		SET(ev->ev_fires, res);
+		if (!ISSET(ev->ev_event, EV_ON_FIRE)) {
+			event_fire_insert(evb, ev);
+			SET(ev->ev_event, EV_ON_FIRE);
+		}
+	}
+}
+
+static void
+event_async_cancel(struct event *ev)
+{
+	/* leave the queued bit so the event isnt pushed a second time */
+	if (__atomic_load_n(&ev->ev_async, __ATOMIC_RELAXED) != 0) {
+		__atomic_and_fetch(&ev->ev_async, EVENT_ASYNC_QUEUED,
+		    __ATOMIC_ACQ_REL);
+	}
+}
+
+/*
+ * the caller may free ev once it has been deleted, so it has to come
+ * off the stack now instead of when the loop gets to it.
+ */
+static void
+event_async_del(struct event_base *evb, struct event *ev)
+{
+	event_async_cancel(ev);
+	if (ISSET(__atomic_load_n(&ev->ev_async, __ATOMIC_ACQUIRE),
+	    EVENT_ASYNC_QUEUED))
+		event_async_drain(evb);
+}
+
+static int
+event_async_init(struct event_base *evb)
+{
+	struct event *ev = &evb->evb_async_ev;
+	int fd;
+
+	evb->evb_async = NULL;
+	evb->evb_async_notified = 0;
+
+#if defined(EVENT_HAS_EVENTFD)
+	fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd == -1)
+		return (-1);
+
+	evb->evb_async_fds[0] = evb->evb_async_fds[1] = fd;
+#else
+	if (pipe2(evb->evb_async_fds, O_NONBLOCK | O_CLOEXEC) == -1)
+		return (-1);
+
+	fd = evb->evb_async_fds[0];
+#endif
+
+	event_set(ev, fd, EV_READ|EV_PERSIST, event_async_read, evb);
+	event_base_set(evb, ev);
+	if (event_add(ev, NULL) != 0) {
+		event_async_fini(evb);
+		return (-1);
+	}
+
+	/* the wakeup fd should not keep the loop running */
+	evb->evb_nevents--;
+
+	return (0);
+}
+
+static void
+event_async_fini(struct event_base *evb)
+{
+	close(evb->evb_async_fds[0]);
+	if (evb->evb_async_fds[1] != evb->evb_async_fds[0])
+		close(evb->evb_async_fds[1]);
+}
+
+static int
+event_monotime(struct event_base *evb, struct timespec *now)
+{
+	if (evb->evb_monotime_cached) {
+		*now = evb->evb_monotime;
+		return (0);
+	}
+
+	return (clock_gettime(evb->evb_monoclock, now));
+}
+
+static int
+event_walltime(struct event_base *evb, struct timespec *now)
+{
+	if (evb->evb_walltime_cached) {
+		*now = evb->evb_walltime;
+		return (0);
+	}
+
+	if (clock_gettime(evb->evb_wallclock, now) == -1)
+		return (-1);
+
+	if (evb->evb_monotime_cached) {
+		/* keep it for the rest of this loop */
+		evb->evb_walltime = *now;
+		evb->evb_walltime_cached = 1;
+	}
+
+	return (0);
+}
+
+static int
+event_deadline(struct event_base *evb, struct timespec *deadline,
+    struct event_ctq **ctqp, const struct timeval *tv)
+{
+	return (event_deadline_slack(evb, deadline, ctqp, tv,
+	    evb->evb_slack));
+}
+
+/*
+ * round the deadline up to a multiple of the slack, so timeouts with
+ * the same slack that are due around the same time share a wakeup.
+ * they are never run early, and at most slack late.
+ */
 static int
-event_deadline(struct timespec *deadline, const struct timeval *tv)
+event_deadline_slack(struct event_base *evb, struct timespec *deadline,
+    struct event_ctq **ctqp, const struct timeval *tv, uint64_t slack)
 {
+	struct event_ctq *ctq = NULL;
 	struct timespec ts;
 	struct timespec now;
+	uint64_t nsec, rem;
+
+	if (ISSET(tv->tv_usec, EVENT_CTQ_MAGIC_MASK) == EVENT_CTQ_MAGIC) {
+		ctq = event_ctq_lookup(evb, tv);
+		if (ctq == NULL)
+			return (-1);
+
+		/* rounding would break the order of the queue */
+		tv = &ctq->ectq_duration;
+		slack = 0;
+	}
 
-	if (event_monotime(&now) == -1)
+	if (event_monotime(evb, &now) == -1)
 		return (-1);
 	TIMEVAL_TO_TIMESPEC(tv, &ts);
 	timespecadd(&ts, &now, deadline);
+	*ctqp = ctq;
+
+	if (slack == 0)
+		return (0);
+
+	nsec = (uint64_t)deadline->tv_sec * 1000000000ULL +
+	    deadline->tv_nsec;
+	rem = nsec % slack;
+	if (rem != 0) {
+		nsec += slack - rem;
+		deadline->tv_sec = nsec / 1000000000ULL;
+		deadline->tv_nsec = nsec % 1000000000ULL;
+	}
 
 	return (0);
 }
 
-static inline int
-event_heap_compare(const struct event *a, const struct event *b)
+static int
+event_slack(const struct timeval *tv, uint64_t *slack)
 {
-	if (a->ev_deadline.tv_sec > b->ev_deadline.tv_sec)
-		return (1);
-	if (a->ev_deadline.tv_sec < b->ev_deadline.tv_sec)
-		return (-1);
-	if (a->ev_deadline.tv_nsec > b->ev_deadline.tv_nsec)
-		return (1);
-	if (a->ev_deadline.tv_nsec < b->ev_deadline.tv_nsec)
+	if (tv == NULL) {
+		*slack = 0;
+		return (0);
+	}
+
+	if (tv->tv_sec < 0 || tv->tv_usec < 0 || tv->tv_usec >= 1000000) {
+		errno = EINVAL;
 		return (-1);
+	}
+
+	*slack = (uint64_t)tv->tv_sec * 1000000000ULL +
+	    (uint64_t)tv->tv_usec * 1000ULL;
 
 	return (0);
 }
 
-HEAP_GENERATE(event_heap, event, ev_heap, event_heap_compare);
+static void
+event_remaining(struct event_base *evb, const struct event *ev,
+    struct timeval *tv)
+{
+	struct timespec now, ts;
+
+	(void)event_monotime(evb, &now);
+	timespecsub(&ev->ev_deadline, &now, &ts);
+	(void)event_walltime(evb, &now);
+	timespecadd(&now, &ts, &ts);
+
+	TIMESPEC_TO_TIMEVAL(tv, &ts);
+}
 
 void *
 event_base_backend(struct event_base *evb)
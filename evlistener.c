@@ -0,0 +1,198 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2017 David Gwynne <dlg@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * listeners drain the backlog each time the socket is readable instead
+ * of taking one connection per pass through the loop. the accepted
+ * fds are handed to the callback a batch at a time, and a few batches
+ * at most are taken before other events get a turn.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <stdlib.h>
+#include <errno.h>
+
+#include "minevent.h"
+#include "minevent-internal.h"
+#include "evlistener.h"
+
+#define EVLISTENER_ROUNDS	4	/* batches per readable event */
+#define EVLISTENER_PAUSE	1	/* seconds to wait for free fds */
+
+#define EVLISTENER_RUNNING	(1 << 0) /* the callback is on the stack */
+#define EVLISTENER_FREED	(1 << 1) /* the callback freed the listener */
+
+struct evlistener {
+	struct event		  el_ev;
+	struct event		  el_pause;
+	unsigned int		  el_batch;
+	unsigned int		  el_flags;
+	evlistenercb		  el_fn;
+	void			 *el_arg;
+	int			  el_fds[];
+};
+
+static void	evlistener_acceptcb(int, short, void *);
+static void	evlistener_pausecb(int, short, void *);
+
+struct evlistener *
+evlistener_new(int fd, short flags, unsigned int batch, evlistenercb fn,
+    void *arg)
+{
+	struct evlistener *el;
+
+	if (batch == 0 || ISSET(flags, ~EV_EXCLUSIVE)) {
+		errno = EINVAL;
+		return (NULL);
+	}
+
+	el = malloc(sizeof(*el) + batch * sizeof(el->el_fds[0]));
+	if (el == NULL)
+		return (NULL);
+
+	event_set(&el->el_ev, fd, EV_READ|EV_PERSIST|flags,
+	    evlistener_acceptcb, el);
+	evtimer_set(&el->el_pause, evlistener_pausecb, el);
+	el->el_batch = batch;
+	el->el_flags = 0;
+	el->el_fn = fn;
+	el->el_arg = arg;
+
+	return (el);
+}
+
+int
+evlistener_base_set(struct event_base *evb, struct evlistener *el)
+{
+	if (event_base_set(evb, &el->el_ev) == -1 ||
+	    event_base_set(evb, &el->el_pause) == -1)
+		return (-1);
+
+	return (0);
+}
+
+void
+evlistener_free(struct evlistener *el)
+{
+	event_del(&el->el_ev);
+	evtimer_del(&el->el_pause);
+
+	/* acceptcb still has el, so it has to do the free */
+	if (ISSET(el->el_flags, EVLISTENER_RUNNING)) {
+		SET(el->el_flags, EVLISTENER_FREED);
+		return;
+	}
+
+	free(el);
+}
+
+int
+evlistener_add(struct evlistener *el)
+{
+	return (event_add(&el->el_ev, NULL));
+}
+
+int
+evlistener_del(struct evlistener *el)
+{
+	if (event_del(&el->el_ev) == -1 || evtimer_del(&el->el_pause) == -1)
+		return (-1);
+
+	return (0);
+}
+
+static void
+evlistener_pause(struct evlistener *el)
+{
+	struct timeval tv = { EVLISTENER_PAUSE, 0 };
+
+	/*
+	 * the connection is still on the backlog, so the socket stays
+	 * readable. stop listening until something has been closed.
+	 */
+	event_del(&el->el_ev);
+	evtimer_add(&el->el_pause, &tv);
+}
+
+static void
+evlistener_pausecb(int nil, short events, void *arg)
+{
+	struct evlistener *el = arg;
+
+	event_add(&el->el_ev, NULL);
+}
+
+static void
+evlistener_acceptcb(int fd, short events, void *arg)
+{
+	struct evlistener *el = arg;
+	unsigned int round, n;
+	int s, error = 0;
+
+	for (round = 0; round < EVLISTENER_ROUNDS; round++) {
+		n = 0;
+		while (n < el->el_batch) {
+			s = accept4(fd, NULL, NULL,
+			    SOCK_NONBLOCK | SOCK_CLOEXEC);
+			if (s == -1) {
+				/* the peer gave up while it was queued */
+				if (errno == EINTR || errno == ECONNABORTED)
+					continue;
+
+				error = errno;
+				break;
+			}
+
+			el->el_fds[n++] = s;
+		}
+
+		if (n > 0) {
+			SET(el->el_flags, EVLISTENER_RUNNING);
+			(*el->el_fn)(el, el->el_fds, n, el->el_arg);
+			CLR(el->el_flags, EVLISTENER_RUNNING);
+
+			if (ISSET(el->el_flags, EVLISTENER_FREED)) {
+				free(el);
+				return;
+			}
+		}
+
+		if (error != 0)
+			break;
+
+		/* the callback may have stopped the listener */
+		if (!event_pending(&el->el_ev, EV_READ, NULL))
+			return;
+	}
+
+	switch (error) {
+	case 0:
+	case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+	case EWOULDBLOCK:
+#endif
+		break;
+	default:
+		/* EMFILE and friends */
+		if (event_pending(&el->el_ev, EV_READ, NULL))
+			evlistener_pause(el);
+		break;
+	}
+}
@@ -0,0 +1,41 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2017 David Gwynne <dlg@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _LIB_EVLISTENER_H_
+#define _LIB_EVLISTENER_H_
+
+#include "minevent.h"
+
+struct evlistener;
+
+/*
+ * the callback owns the fds, which are nonblocking and close on exec.
+ * it may free the listener.
+ */
+typedef void (*evlistenercb)(struct evlistener *, const int *,
+    unsigned int, void *);
+
+struct evlistener	*evlistener_new(int, short, unsigned int, evlistenercb,
+			     void *);
+int			 evlistener_base_set(struct event_base *,
+			     struct evlistener *);
+void			 evlistener_free(struct evlistener *);
+int			 evlistener_add(struct evlistener *);
+int			 evlistener_del(struct evlistener *);
+
+#endif /* _LIB_EVLISTENER_H_ */
@@ -0,0 +1,633 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2017 David Gwynne <dlg@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * a runtime of event loops, one per thread.
+ *
+ * each loop has its own base and runs on its own thread, pinned to a
+ * cpu where the system lets us. listening sockets are opened once per
+ * loop with SO_REUSEPORT so the kernel spreads connections over them.
+ *
+ * work that isn't tied to a loop's events can be deferred to a loop as
+ * a task. each loop keeps its tasks on a deque, runs the newest first,
+ * and lets siblings steal the oldest. a loop with a backlog wakes an
+ * idle sibling, which then steals from it. events stay on the base
+ * they were added to, only tasks move between loops.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "minevent.h"
+#include "minevent-internal.h"
+#include "evrt.h"
+
+#define EVRT_BATCH	64	/* tasks run before the loop polls again */
+#define EVRT_MINTASKS	64
+
+struct evrt_task {
+	void			(*t_fn)(void *);
+	void			 *t_arg;
+};
+
+struct evrt_deque {
+	pthread_mutex_t		  d_mtx;
+	struct evrt_task	 *d_tasks;
+	unsigned int		  d_size; /* a power of 2 */
+	unsigned int		  d_head; /* thieves take from here */
+	unsigned int		  d_tail; /* the owner pushes and pops here */
+};
+
+struct evrt_loop {
+	struct evrt		 *l_rt;
+	unsigned int		  l_idx;
+	struct event_base	 *l_base;
+	struct event		  l_kick;
+	struct evrt_deque	  l_deque;
+	unsigned int		  l_idle;
+
+	pthread_t		  l_thread;
+	int			  l_error;
+};
+
+struct evrt_listener {
+	TAILQ_ENTRY(evrt_listener) rl_entry;
+	struct event		 *rl_evs; /* one per loop */
+};
+
+TAILQ_HEAD(evrt_listeners, evrt_listener);
+
+struct evrt {
+	struct evrt_loop	 *rt_loops;
+	unsigned int		  rt_nloops;
+	struct evrt_listeners	  rt_listeners;
+	int			  rt_running;
+	unsigned int		  rt_stopping;
+};
+
+static __thread struct evrt_loop *evrt_self;
+
+static void	evrt_kick(int, short, void *);
+static void	evrt_share(struct evrt_loop *);
+static void	evrt_listener_close(struct evrt *, struct evrt_listener *,
+		    unsigned int);
+
+static void
+evrt_deque_init(struct evrt_deque *d)
+{
+	pthread_mutex_init(&d->d_mtx, NULL);
+	d->d_tasks = NULL;
+	d->d_size = 0;
+	d->d_head = 0;
+	d->d_tail = 0;
+}
+
+static void
+evrt_deque_destroy(struct evrt_deque *d)
+{
+	pthread_mutex_destroy(&d->d_mtx);
+	free(d->d_tasks);
+}
+
+static int
+evrt_deque_grow(struct evrt_deque *d)
+{
+	struct evrt_task *tasks;
+	unsigned int size, i, n = d->d_tail - d->d_head;
+
+	size = d->d_size ? d->d_size * 2 : EVRT_MINTASKS;
+	tasks = reallocarray(NULL, size, sizeof(*tasks));
+	if (tasks == NULL)
+		return (-1);
+
+	/* unwrap the ring while copying it */
+	for (i = 0; i < n; i++)
+		tasks[i] = d->d_tasks[(d->d_head + i) & (d->d_size - 1)];
+
+	free(d->d_tasks);
+	d->d_tasks = tasks;
+	d->d_size = size;
+	__atomic_store_n(&d->d_head, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&d->d_tail, n, __ATOMIC_RELAXED);
+
+	return (0);
+}
+
+static int
+evrt_deque_push(struct evrt_deque *d, const struct evrt_task *t)
+{
+	int rv = 0;
+
+	pthread_mutex_lock(&d->d_mtx);
+	if (d->d_tail - d->d_head == d->d_size && evrt_deque_grow(d) == -1)
+		rv = -1;
+	else {
+		d->d_tasks[d->d_tail & (d->d_size - 1)] = *t;
+		__atomic_store_n(&d->d_tail, d->d_tail + 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&d->d_mtx);
+
+	return (rv);
+}
+
+static int
+evrt_deque_take(struct evrt_deque *d, struct evrt_task *t, int steal)
+{
+	int rv = 0;
+
+	/* dont bother taking the lock on an empty deque */
+	if (__atomic_load_n(&d->d_head, __ATOMIC_RELAXED) ==
+	    __atomic_load_n(&d->d_tail, __ATOMIC_RELAXED))
+		return (0);
+
+	pthread_mutex_lock(&d->d_mtx);
+	if (d->d_head != d->d_tail) {
+		if (steal) {
+			*t = d->d_tasks[d->d_head & (d->d_size - 1)];
+			__atomic_store_n(&d->d_head, d->d_head + 1,
+			    __ATOMIC_RELAXED);
+		} else {
+			__atomic_store_n(&d->d_tail, d->d_tail - 1,
+			    __ATOMIC_RELAXED);
+			*t = d->d_tasks[d->d_tail & (d->d_size - 1)];
+		}
+		rv = 1;
+	}
+	pthread_mutex_unlock(&d->d_mtx);
+
+	return (rv);
+}
+
+struct evrt *
+evrt_new(unsigned int nloops)
+{
+	struct evrt *rt;
+	struct evrt_loop *loop;
+	unsigned int i;
+	long ncpu;
+	int error;
+
+	if (nloops == 0) {
+		ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		nloops = ncpu > 0 ? ncpu : 1;
+	}
+
+	rt = malloc(sizeof(*rt));
+	if (rt == NULL)
+		return (NULL);
+
+	rt->rt_loops = calloc(nloops, sizeof(*rt->rt_loops));
+	if (rt->rt_loops == NULL) {
+		free(rt);
+		return (NULL);
+	}
+
+	for (i = 0; i < nloops; i++) {
+		loop = &rt->rt_loops[i];
+
+		loop->l_base = event_base_new();
+		if (loop->l_base == NULL)
+			goto fail;
+
+		loop->l_rt = rt;
+		loop->l_idx = i;
+		evtimer_set(&loop->l_kick, evrt_kick, loop);
+		event_base_set(loop->l_base, &loop->l_kick);
+		evrt_deque_init(&loop->l_deque);
+		loop->l_idle = 1;
+		loop->l_error = 0;
+	}
+
+	rt->rt_nloops = nloops;
+	TAILQ_INIT(&rt->rt_listeners);
+	rt->rt_running = 0;
+	rt->rt_stopping = 0;
+
+	return (rt);
+
+fail:
+	error = errno;
+	while (i-- > 0) {
+		loop = &rt->rt_loops[i];
+		evrt_deque_destroy(&loop->l_deque);
+		event_base_free(loop->l_base);
+	}
+	free(rt->rt_loops);
+	free(rt);
+	errno = error;
+
+	return (NULL);
+}
+
+void
+evrt_free(struct evrt *rt)
+{
+	struct evrt_listener *rl;
+	struct evrt_loop *loop;
+	unsigned int i;
+
+	/*
+	 * the loops can't be stopped from one of their own threads, and
+	 * freeing them while they run would pull the bases out from under
+	 * every thread.
+	 */
+	if (evrt_current(rt) != -1)
+		abort();
+
+	if (rt->rt_running)
+		evrt_stop(rt);
+
+	while ((rl = TAILQ_FIRST(&rt->rt_listeners)) != NULL) {
+		TAILQ_REMOVE(&rt->rt_listeners, rl, rl_entry);
+		evrt_listener_close(rt, rl, rt->rt_nloops);
+	}
+
+	for (i = 0; i < rt->rt_nloops; i++) {
+		loop = &rt->rt_loops[i];
+		evrt_deque_destroy(&loop->l_deque);
+		event_base_free(loop->l_base);
+	}
+
+	free(rt->rt_loops);
+	free(rt);
+}
+
+static void
+evrt_pin(struct evrt_loop *loop)
+{
+#if defined(__linux__)
+	cpu_set_t cpus, cpu;
+	unsigned int n, c;
+
+	/* pick from the cpus we were allowed to run on */
+	if (sched_getaffinity(0, sizeof(cpus), &cpus) == -1)
+		return;
+
+	n = loop->l_idx % CPU_COUNT(&cpus);
+	for (c = 0; c < CPU_SETSIZE; c++) {
+		if (!CPU_ISSET(c, &cpus))
+			continue;
+		if (n-- == 0)
+			break;
+	}
+
+	CPU_ZERO(&cpu);
+	CPU_SET(c, &cpu);
+
+	/* it's only a hint, the loop still works if this fails */
+	pthread_setaffinity_np(pthread_self(), sizeof(cpu), &cpu);
+#endif
+}
+
+static void *
+evrt_loop_main(void *arg)
+{
+	struct evrt_loop *loop = arg;
+
+	evrt_self = loop;
+	evrt_pin(loop);
+
+	if (event_base_loop(loop->l_base, EVLOOP_NO_EXIT_ON_EMPTY) == -1)
+		loop->l_error = errno;
+
+	evrt_self = NULL;
+
+	return (NULL);
+}
+
+static void
+evrt_join(struct evrt *rt, unsigned int n)
+{
+	unsigned int i;
+
+	__atomic_store_n(&rt->rt_stopping, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < n; i++)
+		event_active(&rt->rt_loops[i].l_kick, EV_TIMEOUT);
+	for (i = 0; i < n; i++)
+		pthread_join(rt->rt_loops[i].l_thread, NULL);
+}
+
+int
+evrt_start(struct evrt *rt)
+{
+	struct evrt_loop *loop;
+	unsigned int i;
+	int error;
+
+	if (rt->rt_running) {
+		errno = EBUSY;
+		return (-1);
+	}
+
+	rt->rt_stopping = 0;
+	for (i = 0; i < rt->rt_nloops; i++) {
+		loop = &rt->rt_loops[i];
+		loop->l_error = 0;
+
+		/* run anything that was deferred before we started */
+		event_active(&loop->l_kick, EV_TIMEOUT);
+
+		error = pthread_create(&loop->l_thread, NULL,
+		    evrt_loop_main, loop);
+		if (error != 0) {
+			evrt_join(rt, i);
+			errno = error;
+			return (-1);
+		}
+	}
+
+	rt->rt_running = 1;
+
+	return (0);
+}
+
+int
+evrt_stop(struct evrt *rt)
+{
+	unsigned int i;
+	int error = 0;
+
+	if (!rt->rt_running)
+		return (0);
+
+	/* a loop can't wait for itself to finish */
+	if (evrt_self != NULL && evrt_self->l_rt == rt) {
+		errno = EDEADLK;
+		return (-1);
+	}
+
+	evrt_join(rt, rt->rt_nloops);
+	rt->rt_running = 0;
+
+	for (i = 0; i < rt->rt_nloops; i++) {
+		if (rt->rt_loops[i].l_error != 0) {
+			error = rt->rt_loops[i].l_error;
+			break;
+		}
+	}
+
+	if (error != 0) {
+		errno = error;
+		return (-1);
+	}
+
+	return (0);
+}
+
+unsigned int
+evrt_nloops(const struct evrt *rt)
+{
+	return (rt->rt_nloops);
+}
+
+struct event_base *
+evrt_base(struct evrt *rt, unsigned int idx)
+{
+	if (idx >= rt->rt_nloops) {
+		errno = EINVAL;
+		return (NULL);
+	}
+
+	return (rt->rt_loops[idx].l_base);
+}
+
+int
+evrt_current(const struct evrt *rt)
+{
+	if (evrt_self == NULL || evrt_self->l_rt != rt)
+		return (-1);
+
+	return (evrt_self->l_idx);
+}
+
+/*
+ * tasks
+ */
+
+static int
+evrt_steal(struct evrt_loop *loop, struct evrt_task *t)
+{
+	struct evrt *rt = loop->l_rt;
+	struct evrt_loop *sib;
+	unsigned int i;
+
+	for (i = 1; i < rt->rt_nloops; i++) {
+		sib = &rt->rt_loops[(loop->l_idx + i) % rt->rt_nloops];
+		if (evrt_deque_take(&sib->l_deque, t, 1))
+			return (1);
+	}
+
+	return (0);
+}
+
+static void
+evrt_share(struct evrt_loop *loop)
+{
+	struct evrt *rt = loop->l_rt;
+	struct evrt_loop *sib;
+	unsigned int i;
+
+	/* wake one idle sibling up so it can steal from us */
+	for (i = 1; i < rt->rt_nloops; i++) {
+		sib = &rt->rt_loops[(loop->l_idx + i) % rt->rt_nloops];
+		if (__atomic_load_n(&sib->l_idle, __ATOMIC_RELAXED) &&
+		    __atomic_exchange_n(&sib->l_idle, 0, __ATOMIC_ACQ_REL)) {
+			event_active(&sib->l_kick, EV_TIMEOUT);
+			return;
+		}
+	}
+}
+
+static void
+evrt_kick(int nil, short events, void *arg)
+{
+	struct evrt_loop *loop = arg;
+	struct evrt *rt = loop->l_rt;
+	struct evrt_task t;
+	unsigned int n;
+	int shared = 0;
+
+	if (__atomic_load_n(&rt->rt_stopping, __ATOMIC_ACQUIRE)) {
+		event_base_loopbreak(loop->l_base);
+		return;
+	}
+
+	__atomic_store_n(&loop->l_idle, 0, __ATOMIC_RELEASE);
+	for (n = 0; n < EVRT_BATCH; n++) {
+		if (!evrt_deque_take(&loop->l_deque, &t, 0)) {
+			if (!evrt_steal(loop, &t)) {
+				__atomic_store_n(&loop->l_idle, 1,
+				    __ATOMIC_RELEASE);
+				return;
+			}
+
+			/* someone is behind, get the next loop along too */
+			if (!shared) {
+				evrt_share(loop);
+				shared = 1;
+			}
+		}
+
+		(*t.t_fn)(t.t_arg);
+	}
+
+	/* there's more, but let the i/o in and get some help */
+	event_active(&loop->l_kick, EV_TIMEOUT);
+	evrt_share(loop);
+}
+
+int
+evrt_defer(struct evrt *rt, unsigned int idx, void (*fn)(void *), void *arg)
+{
+	struct evrt_loop *loop;
+	struct evrt_task t = { fn, arg };
+
+	if (idx >= rt->rt_nloops) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	loop = &rt->rt_loops[idx];
+	if (evrt_deque_push(&loop->l_deque, &t) == -1)
+		return (-1);
+
+	event_active(&loop->l_kick, EV_TIMEOUT);
+	if (!__atomic_load_n(&loop->l_idle, __ATOMIC_ACQUIRE))
+		evrt_share(loop);
+
+	return (0);
+}
+
+/*
+ * listeners
+ */
+
+static int
+evrt_socket(const struct sockaddr_storage *ss, socklen_t sslen, int backlog)
+{
+	int s, error, on = 1;
+
+	s = socket(ss->ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+	    0);
+	if (s == -1)
+		return (-1);
+
+	if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1 ||
+	    setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1 ||
+	    bind(s, (const struct sockaddr *)ss, sslen) == -1 ||
+	    listen(s, backlog) == -1) {
+		error = errno;
+		close(s);
+		errno = error;
+		return (-1);
+	}
+
+	return (s);
+}
+
+static void
+evrt_listener_close(struct evrt *rt, struct evrt_listener *rl,
+    unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		event_del(&rl->rl_evs[i]);
+		close(EVENT_FD(&rl->rl_evs[i]));
+	}
+
+	free(rl->rl_evs);
+	free(rl);
+}
+
+int
+evrt_listen(struct evrt *rt, const struct sockaddr *sa, socklen_t salen,
+    int backlog, void (*fn)(int, short, void *), void *arg)
+{
+	struct sockaddr_storage ss;
+	socklen_t sslen = salen;
+	struct evrt_listener *rl;
+	struct event *ev;
+	unsigned int i;
+	int s, error;
+
+	/* the bases belong to the loop threads once they're running */
+	if (rt->rt_running) {
+		errno = EBUSY;
+		return (-1);
+	}
+
+	if (salen > sizeof(ss)) {
+		errno = EINVAL;
+		return (-1);
+	}
+	memcpy(&ss, sa, salen);
+
+	rl = malloc(sizeof(*rl));
+	if (rl == NULL)
+		return (-1);
+
+	rl->rl_evs = calloc(rt->rt_nloops, sizeof(*rl->rl_evs));
+	if (rl->rl_evs == NULL) {
+		free(rl);
+		return (-1);
+	}
+
+	for (i = 0; i < rt->rt_nloops; i++) {
+		s = evrt_socket(&ss, sslen, backlog);
+		if (s == -1)
+			goto fail;
+
+		/* port 0 picks a port once, the rest share it */
+		if (i == 0 && getsockname(s, (struct sockaddr *)&ss,
+		    &sslen) == -1) {
+			error = errno;
+			close(s);
+			errno = error;
+			goto fail;
+		}
+
+		ev = &rl->rl_evs[i];
+		event_set(ev, s, EV_READ|EV_PERSIST, fn, arg);
+		event_base_set(rt->rt_loops[i].l_base, ev);
+		if (event_add(ev, NULL) == -1) {
+			error = errno;
+			close(s);
+			errno = error;
+			goto fail;
+		}
+	}
+
+	TAILQ_INSERT_TAIL(&rt->rt_listeners, rl, rl_entry);
+
+	return (0);
+
+fail:
+	error = errno;
+	evrt_listener_close(rt, rl, i);
+	errno = error;
+
+	return (-1);
+}
@@ -0,0 +1,44 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2017 David Gwynne <dlg@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _LIB_EVRT_H_
+#define _LIB_EVRT_H_
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "minevent.h"
+
+struct evrt;
+
+struct evrt		*evrt_new(unsigned int);
+void			 evrt_free(struct evrt *);
+int			 evrt_start(struct evrt *);
+int			 evrt_stop(struct evrt *);
+
+unsigned int		 evrt_nloops(const struct evrt *);
+struct event_base	*evrt_base(struct evrt *, unsigned int);
+int			 evrt_current(const struct evrt *);
+
+int			 evrt_listen(struct evrt *, const struct sockaddr *,
+			     socklen_t, int, void (*)(int, short, void *),
+			     void *);
+int			 evrt_defer(struct evrt *, unsigned int,
+			     void (*)(void *), void *);
+
+#endif /* _LIB_EVRT_H_ */
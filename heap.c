@@ -16,7 +16,8 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-#include <sys/_null.h>
+#include <stddef.h>
+
 #include "minevent.h"
 #include "heap.h"
 
@@ -81,24 +82,6 @@ _heap_merge(const struct _heap_type *t,
 	return (lo);
 }
 
-static inline void
-_heap_sibling_remove(struct _heap_entry *he)
-{
-	if (he->he_left == NULL)
-		return;
-
-	if (he->he_left->he_child == he) {
-		if ((he->he_left->he_child = he->he_nextsibling) != NULL)
-			he->he_nextsibling->he_left = he->he_left;
-	} else {
-		if ((he->he_left->he_nextsibling = he->he_nextsibling) != NULL)
-			he->he_nextsibling->he_left = he->he_left;
-	}
-
-	he->he_left = NULL;
-	he->he_nextsibling = NULL;
-}
-
 static inline struct _heap_entry *
 _heap_2pass_merge(const struct _heap_type *t, struct _heap_entry *root)
 {
@@ -209,3 +192,47 @@ _heap_cextract(const struct _heap_type *t, struct _heap *h, const void *key)
 
 	return (node);
 }
+
+/*
+ * take every node that is less than or equal to key out of the heap in
+ * one walk. the nodes that are taken out form a subtree at the root,
+ * and the children that are left over are merged back together once
+ * at the end. fn is called on each node after it has left the heap,
+ * but not in order.
+ */
+void
+_heap_extract_le(const struct _heap_type *t, struct _heap *h, const void *key,
+    void (*fn)(void *, void *), void *arg)
+{
+	struct _heap_entry *he, *child, *next;
+	struct _heap_entry *todo, *rest = NULL;
+	struct _heap_entry root;
+
+	todo = h->h_root;
+	if (todo == NULL || t->t_compare(heap_e2n(t, todo), key) > 0)
+		return;
+
+	while ((he = todo) != NULL) {
+		todo = he->he_nextsibling;
+
+		for (child = he->he_child; child != NULL; child = next) {
+			next = child->he_nextsibling;
+			if (t->t_compare(heap_e2n(t, child), key) <= 0) {
+				child->he_nextsibling = todo;
+				todo = child;
+			} else {
+				child->he_nextsibling = rest;
+				rest = child;
+			}
+		}
+
+		he->he_left = NULL;
+		he->he_child = NULL;
+		he->he_nextsibling = NULL;
+
+		(*fn)(heap_e2n(t, he), arg);
+	}
+
+	root.he_child = rest;
+	h->h_root = _heap_2pass_merge(t, &root);
+}
@@ -32,6 +32,8 @@ void	*_heap_first(const struct _heap_type *, struct _heap *);
 void	*_heap_extract(const struct _heap_type *, struct _heap *);
 void	*_heap_cextract(const struct _heap_type *, struct _heap *,
 	     const void *);
+void	 _heap_extract_le(const struct _heap_type *, struct _heap *,
+	     const void *, void (*)(void *, void *), void *);
 
 #define HEAP_INITIALIZER(_head)	{ { NULL } }
 
@@ -74,6 +76,13 @@ _name##_HEAP_CEXTRACT(struct _name *head, const struct _type *key)	\
 	return _heap_cextract(_name##_HEAP_TYPE, &head->heap, key);	\
 }									\
 									\
+static inline void							\
+_name##_HEAP_EXTRACT_LE(struct _name *head, const struct _type *key,	\
+    void (*fn)(void *, void *), void *arg)				\
+{									\
+	_heap_extract_le(_name##_HEAP_TYPE, &head->heap, key, fn, arg);	\
+}									\
+									\
 static inline int							\
 _name##_HEAP_EMPTY(struct _name *head)					\
 {									\
@@ -93,12 +102,250 @@ static const struct _heap_type _name##_HEAP_INFO = {			\
 };									\
 const struct _heap_type *const _name##_HEAP_TYPE = &_name##_HEAP_INFO
 
+/*
+ * HEAP_GENERATE_INLINE is used instead of both HEAP_PROTOTYPE and
+ * HEAP_GENERATE. it generates a complete heap for the type with the
+ * comparator called directly, which lets the compiler inline it. this
+ * costs a copy of the heap code for every type it is used with.
+ */
+
+static inline void
+_heap_sibling_remove(struct _heap_entry *he)
+{
+	if (he->he_left == NULL)
+		return;
+
+	if (he->he_left->he_child == he) {
+		if ((he->he_left->he_child = he->he_nextsibling) != NULL)
+			he->he_nextsibling->he_left = he->he_left;
+	} else {
+		if ((he->he_left->he_nextsibling = he->he_nextsibling) != NULL)
+			he->he_nextsibling->he_left = he->he_left;
+	}
+
+	he->he_left = NULL;
+	he->he_nextsibling = NULL;
+}
+
+#define HEAP_GENERATE_INLINE(_name, _type, _field, _cmp)		\
+static inline struct _heap_entry *					\
+_name##_HEAP_N2E(struct _type *elm)					\
+{									\
+	return (&elm->_field);						\
+}									\
+									\
+static inline struct _type *						\
+_name##_HEAP_E2N(struct _heap_entry *he)				\
+{									\
+	unsigned long addr = (unsigned long)he;				\
+									\
+	return ((struct _type *)(addr -					\
+	    offsetof(struct _type, _field)));				\
+}									\
+									\
+static inline struct _heap_entry *					\
+_name##_HEAP_MERGE(struct _heap_entry *he1, struct _heap_entry *he2)	\
+{									\
+	struct _heap_entry *hi, *lo;					\
+	struct _heap_entry *child;					\
+									\
+	if (he1 == NULL)						\
+		return (he2);						\
+	if (he2 == NULL)						\
+		return (he1);						\
+									\
+	if (_cmp(_name##_HEAP_E2N(he1), _name##_HEAP_E2N(he2)) >= 0) {	\
+		hi = he1;						\
+		lo = he2;						\
+	} else {							\
+		lo = he1;						\
+		hi = he2;						\
+	}								\
+									\
+	child = lo->he_child;						\
+									\
+	hi->he_left = lo;						\
+	hi->he_nextsibling = child;					\
+	if (child != NULL)						\
+		child->he_left = hi;					\
+	lo->he_child = hi;						\
+	lo->he_left = NULL;						\
+	lo->he_nextsibling = NULL;					\
+									\
+	return (lo);							\
+}									\
+									\
+static inline struct _heap_entry *					\
+_name##_HEAP_2PASS_MERGE(struct _heap_entry *root)			\
+{									\
+	struct _heap_entry *node, *next = NULL;				\
+	struct _heap_entry *tmp, *list = NULL;				\
+									\
+	node = root->he_child;						\
+	if (node == NULL)						\
+		return (NULL);						\
+									\
+	root->he_child = NULL;						\
+									\
+	/* first pass */						\
+	for (next = node->he_nextsibling; next != NULL;			\
+	    next = (node != NULL ? node->he_nextsibling : NULL)) {	\
+		tmp = next->he_nextsibling;				\
+		node = _name##_HEAP_MERGE(node, next);			\
+									\
+		/* insert head */					\
+		node->he_nextsibling = list;				\
+		list = node;						\
+		node = tmp;						\
+	}								\
+									\
+	/* odd child case */						\
+	if (node != NULL) {						\
+		node->he_nextsibling = list;				\
+		list = node;						\
+	}								\
+									\
+	/* second pass */						\
+	while (list->he_nextsibling != NULL) {				\
+		tmp = list->he_nextsibling->he_nextsibling;		\
+		list = _name##_HEAP_MERGE(list, list->he_nextsibling);	\
+		list->he_nextsibling = tmp;				\
+	}								\
+									\
+	list->he_left = NULL;						\
+	list->he_nextsibling = NULL;					\
+									\
+	return (list);							\
+}									\
+									\
+static inline void							\
+_name##_HEAP_INIT(struct _name *head)					\
+{									\
+	_heap_init(&head->heap);					\
+}									\
+									\
+static inline void							\
+_name##_HEAP_INSERT(struct _name *head, struct _type *elm)		\
+{									\
+	struct _heap_entry *he = _name##_HEAP_N2E(elm);			\
+									\
+	he->he_left = NULL;						\
+	he->he_child = NULL;						\
+	he->he_nextsibling = NULL;					\
+									\
+	head->heap.h_root = _name##_HEAP_MERGE(head->heap.h_root, he);	\
+}									\
+									\
+static inline struct _type *						\
+_name##_HEAP_FIRST(struct _name *head)					\
+{									\
+	struct _heap_entry *first = head->heap.h_root;			\
+									\
+	if (first == NULL)						\
+		return (NULL);						\
+									\
+	return (_name##_HEAP_E2N(first));				\
+}									\
+									\
+static inline struct _type *						\
+_name##_HEAP_EXTRACT(struct _name *head)				\
+{									\
+	struct _heap_entry *first = head->heap.h_root;			\
+									\
+	if (first == NULL)						\
+		return (NULL);						\
+									\
+	head->heap.h_root = _name##_HEAP_2PASS_MERGE(first);		\
+									\
+	return (_name##_HEAP_E2N(first));				\
+}									\
+									\
+static inline void							\
+_name##_HEAP_REMOVE(struct _name *head, struct _type *elm)		\
+{									\
+	struct _heap_entry *he = _name##_HEAP_N2E(elm);			\
+									\
+	if (he->he_left == NULL) {					\
+		_name##_HEAP_EXTRACT(head);				\
+		return;							\
+	}								\
+									\
+	_heap_sibling_remove(he);					\
+	head->heap.h_root = _name##_HEAP_MERGE(head->heap.h_root,	\
+	    _name##_HEAP_2PASS_MERGE(he));				\
+}									\
+									\
+static inline struct _type *						\
+_name##_HEAP_CEXTRACT(struct _name *head, const struct _type *key)	\
+{									\
+	struct _heap_entry *first = head->heap.h_root;			\
+	struct _type *elm;						\
+									\
+	if (first == NULL)						\
+		return (NULL);						\
+									\
+	elm = _name##_HEAP_E2N(first);					\
+	if (_cmp(elm, key) > 0)						\
+		return (NULL);						\
+									\
+	head->heap.h_root = _name##_HEAP_2PASS_MERGE(first);		\
+									\
+	return (elm);							\
+}									\
+									\
+static inline void							\
+_name##_HEAP_EXTRACT_LE(struct _name *head, const struct _type *key,	\
+    void (*fn)(void *, void *), void *arg)				\
+{									\
+	struct _heap_entry *he, *child, *next;				\
+	struct _heap_entry *todo, *rest = NULL;				\
+	struct _heap_entry root;					\
+									\
+	todo = head->heap.h_root;					\
+	if (todo == NULL || _cmp(_name##_HEAP_E2N(todo), key) > 0)	\
+		return;							\
+									\
+	while ((he = todo) != NULL) {					\
+		todo = he->he_nextsibling;				\
+									\
+		child = he->he_child;					\
+		while (child != NULL) {					\
+			next = child->he_nextsibling;			\
+			if (_cmp(_name##_HEAP_E2N(child), key) <= 0) {	\
+				child->he_nextsibling = todo;		\
+				todo = child;				\
+			} else {					\
+				child->he_nextsibling = rest;		\
+				rest = child;				\
+			}						\
+			child = next;					\
+		}							\
+									\
+		he->he_left = NULL;					\
+		he->he_child = NULL;					\
+		he->he_nextsibling = NULL;				\
+									\
+		(*fn)(_name##_HEAP_E2N(he), arg);			\
+	}								\
+									\
+	root.he_child = rest;						\
+	head->heap.h_root = _name##_HEAP_2PASS_MERGE(&root);		\
+}									\
+									\
+static inline int							\
+_name##_HEAP_EMPTY(struct _name *head)					\
+{									\
+	return (head->heap.h_root == NULL);				\
+}
+
 #define HEAP_INIT(_name, _h)		_name##_HEAP_INIT((_h))
 #define HEAP_INSERT(_name, _h, _e)	_name##_HEAP_INSERT((_h), (_e))
 #define HEAP_REMOVE(_name, _h, _e)	_name##_HEAP_REMOVE((_h), (_e))
 #define HEAP_FIRST(_name, _h)		_name##_HEAP_FIRST((_h))
 #define HEAP_EXTRACT(_name, _h)		_name##_HEAP_EXTRACT((_h))
 #define HEAP_CEXTRACT(_name, _h, _k)	_name##_HEAP_CEXTRACT((_h), (_k))
+#define HEAP_EXTRACT_LE(_name, _h, _k, _fn, _a)				\
+	_name##_HEAP_EXTRACT_LE((_h), (_k), (_fn), (_a))
 #define HEAP_EMPTY(_name, _h)		_name##_HEAP_EMPTY((_h))
 
 #endif /* _LIB_EVENT_HEAP_H_ */
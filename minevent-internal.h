@@ -25,12 +25,14 @@
 #define EV_ON_LIST	(1 << 1)
 #define EV_ON_HEAP	(1 << 3)
 #define EV_ON_FIRE	(1 << 2)
+#define EV_ON_COMMON	(1 << 12)	/* timeout is on a common queue */
 
 /*
  * internally we use the type as a field, but it is used by the API as flags.
  */
 #define EV_TYPE_MASK	(0xf << 4)
 #define EV_IO		(0 << 4)
+#define EV_COMMON	(3 << 4)	/* stands in for a common queue */
 /*
 #define EV_TIMEOUT	(1 << 4)
 #define EV_SIGNAL	(2 << 4)
@@ -38,11 +40,53 @@
 #define EV_READ		(1 << 8)
 #define EV_WRITE 	(1 << 9)
 #define EV_PERSIST	(1 << 10)
+#define EV_ET		(1 << 11)
+#define EV_EXCLUSIVE	(1 << 13)
 */
 
 /* EV_TIMEOUT is handled separately */
 #define EV_PENDING_MASK	(EV_SIGNAL | EV_READ | EV_WRITE | EV_PERSIST)
 
+#ifndef timespecadd
+#define timespecadd(_a, _b, _r) do {					\
+	(_r)->tv_sec = (_a)->tv_sec + (_b)->tv_sec;			\
+	(_r)->tv_nsec = (_a)->tv_nsec + (_b)->tv_nsec;			\
+	if ((_r)->tv_nsec >= 1000000000L) {				\
+		(_r)->tv_sec++;						\
+		(_r)->tv_nsec -= 1000000000L;				\
+	}								\
+} while (0)
+#endif
+
+#ifndef timespecsub
+#define timespecsub(_a, _b, _r) do {					\
+	(_r)->tv_sec = (_a)->tv_sec - (_b)->tv_sec;			\
+	(_r)->tv_nsec = (_a)->tv_nsec - (_b)->tv_nsec;			\
+	if ((_r)->tv_nsec < 0) {					\
+		(_r)->tv_sec--;						\
+		(_r)->tv_nsec += 1000000000L;				\
+	}								\
+} while (0)
+#endif
+
+#ifndef timespeccmp
+#define timespeccmp(_a, _b, _cmp)					\
+	(((_a)->tv_sec == (_b)->tv_sec) ?				\
+	    ((_a)->tv_nsec _cmp (_b)->tv_nsec) :			\
+	    ((_a)->tv_sec _cmp (_b)->tv_sec))
+#endif
+
+#ifndef timespecclear
+#define timespecclear(_ts)	((_ts)->tv_sec = (_ts)->tv_nsec = 0)
+#endif
+
+#ifndef TAILQ_FOREACH_SAFE
+#define TAILQ_FOREACH_SAFE(_var, _head, _field, _tvar)			\
+	for ((_var) = TAILQ_FIRST(_head);				\
+	    (_var) != NULL && ((_tvar) = TAILQ_NEXT(_var, _field), 1);	\
+	    (_var) = (_tvar))
+#endif
+
 #define SET(_v, _m)	((_v) |= (_m))
 #define CLR(_v, _m)	((_v) &= ~(_m))
 #define ISSET(_v, _m)	((_v) & (_m))
@@ -55,6 +99,8 @@ struct event_ops {
 
 	int		 (*evo_event_add)(struct event_base *, struct event *);
 	int		 (*evo_event_del)(struct event_base *, struct event *);
+	int		 (*evo_event_mod)(struct event_base *, struct event *,
+			       short);
 	int		 (*evo_signal_add)(struct event_base *, int);
 	int		 (*evo_signal_del)(struct event_base *, int);
 };
@@ -63,6 +109,86 @@ void	*event_base_backend(struct event_base *);
 
 void	 event_fire_event(struct event_base *, struct event *, short);
 void	 event_fire_signal(struct event_base *, int);
+void	 event_set_siginfo(struct event_base *,
+	     const struct event_siginfo *);
+
+/*
+ * backend record allocation
+ */
+
+#define EVENT_POOL_SHIFT	8
+#define EVENT_POOL_CHUNK	(1U << EVENT_POOL_SHIFT)
+#define EVENT_POOL_NONE		(~0U)
+
+struct event_pool {
+	void		**evpl_chunks;
+	unsigned int	  evpl_nchunks;
+	unsigned int	  evpl_chunkslen;
+	size_t		  evpl_size;
+
+	unsigned int	 *evpl_free;
+	unsigned int	  evpl_nfree;
+	unsigned int	  evpl_freelen;
+};
+
+void		 event_pool_init(struct event_pool *, size_t);
+void		 event_pool_destroy(struct event_pool *);
+unsigned int	 event_pool_get(struct event_pool *);
+void		 event_pool_put(struct event_pool *, unsigned int);
+
+static inline void *
+event_pool_item(const struct event_pool *evpl, unsigned int idx)
+{
+	char *chunk = evpl->evpl_chunks[idx >> EVENT_POOL_SHIFT];
+
+	return (chunk + (idx & (EVENT_POOL_CHUNK - 1)) * evpl->evpl_size);
+}
+
+unsigned int	 event_grow(unsigned int, unsigned int);
+
+/*
+ * timing wheel for timeouts
+ */
+
+struct event_wheel;
+
+struct event_wheel *
+		 event_wheel_create(const struct timespec *,
+		     const struct timespec *);
+void		 event_wheel_destroy(struct event_wheel *);
+void		 event_wheel_insert(struct event_wheel *, struct event *);
+void		 event_wheel_remove(struct event_wheel *, struct event *);
+struct event	*event_wheel_cextract(struct event_wheel *,
+		     const struct timespec *);
+int		 event_wheel_next(const struct event_wheel *,
+		     struct timespec *);
+
+struct event_signals;
+
+int	event_signals_add(struct event_base *, struct event_signals **, int);
+int	event_signals_del(struct event_base *, struct event_signals **, int);
+int	event_signals_scan(struct event_base *, struct event_signals *);
+void	event_signals_destroy(struct event_signals *);
+
+#if defined(__linux__) && !defined(EVENT_HAS_EPOLL)
+#define EVENT_HAS_EPOLL
+#endif
+
+#if defined(__linux__) && !defined(EVENT_HAS_EVENTFD)
+#define EVENT_HAS_EVENTFD
+#endif
+
+#if defined(__linux__) && !defined(EVENT_HAS_SPLICE)
+#define EVENT_HAS_SPLICE
+#endif
+
+#if defined(__linux__) && !defined(EVENT_HAS_SENDFILE)
+#define EVENT_HAS_SENDFILE
+#endif
+
+#if defined(__linux__) && !defined(EVENT_HAS_MMSG)
+#define EVENT_HAS_MMSG
+#endif
 
 #if 1 && defined(EVENT_HAS_KQUEUE)
 extern const struct event_ops event_kqueue_ops;
@@ -71,13 +197,28 @@ extern const struct event_ops event_kqueue_ops;
 #endif
 #endif
 
+#if 1 && defined(EVENT_HAS_IO_URING)
+extern const struct event_ops event_uring_ops;
+#ifndef EVENT_OPS_DEFAULT
+#define EVENT_OPS_DEFAULT (&event_uring_ops)
+#endif
+#endif
+
+#if 1 && defined(EVENT_HAS_EPOLL)
+extern const struct event_ops event_epoll_ops;
+#ifndef EVENT_OPS_DEFAULT
+#define EVENT_OPS_DEFAULT (&event_epoll_ops)
+#endif
+#endif
+
 extern const struct event_ops event_poll_ops;
 #ifndef EVENT_OPS_DEFAULT
 #define EVENT_OPS_DEFAULT (&event_poll_ops)
 #endif
 
-#define	event_walltime(_ts)	clock_gettime(CLOCK_REALTIME, (_ts))
-#define	event_monotime(_ts)	clock_gettime(CLOCK_MONOTONIC, (_ts))
+#if defined(CLOCK_MONOTONIC_COARSE) && defined(CLOCK_REALTIME_COARSE)
+#define EVENT_HAS_CLOCK_COARSE
+#endif
 
 void	event_list_init(struct event_base *);
 void	event_list_insert(struct event_base *, struct event *);
@@ -20,8 +20,10 @@
 #ifndef _LIB_EVENT_H_
 #define _LIB_EVENT_H_
 
+#include <sys/types.h>
 #include <sys/queue.h>
 #include <sys/time.h>
+#include <stdint.h>
 #include <time.h>
 
 struct event_base;
@@ -47,7 +49,15 @@ struct event {
 	struct event_base	 *ev_base;
 	TAILQ_ENTRY(event)	  ev_list;
 	TAILQ_ENTRY(event)	  ev_fire;
-	HEAP_ENTRY()		  ev_heap;
+	union {
+		HEAP_ENTRY()		 evt_heap;
+		LIST_ENTRY(event)	 evt_wheel;
+		unsigned int		 evt_idx;
+		struct {
+			TAILQ_ENTRY(event)	 evtc_entry;
+			unsigned int		 evtc_idx;
+		}			 evt_common;
+	}			  ev_timer;
 	struct timespec		  ev_deadline;
 
 	void			(*ev_fn)(int, short, void *);
@@ -55,6 +65,42 @@ struct event {
 	int			  ev_ident; /* fd/signal */
 	short			  ev_event;
 	short			  ev_fires;
+
+	struct event		 *ev_async_next;
+	unsigned int		  ev_async;
+	int			  ev_pri;
+};
+
+/* what the backend knows about the last delivery of a signal */
+struct event_siginfo {
+	int			  esi_signo;
+	int			  esi_code;
+	pid_t			  esi_pid;
+	uid_t			  esi_uid;
+	int			  esi_status;
+};
+
+/*
+ * what a base has been up to, if it was built with EVENT_STATS.
+ * bucket n of a histogram counts times under 2^n nsec that did not fit
+ * in bucket n - 1, and the last bucket counts everything longer.
+ */
+#define EVENT_STATS_BUCKETS	32
+
+struct event_stats {
+	uint64_t		  evs_loops;
+	uint64_t		  evs_wait_nsec; /* in the backend */
+	uint64_t		  evs_fired_io;
+	uint64_t		  evs_fired_timeout;
+	uint64_t		  evs_fired_signal;
+	uint64_t		  evs_callbacks;
+	uint64_t		  evs_backend_add;
+	uint64_t		  evs_backend_del;
+	uint64_t		  evs_backend_mod;
+
+	uint64_t		  evs_callback_nsec[EVENT_STATS_BUCKETS];
+	/* how late timeouts were when the loop got to them */
+	uint64_t		  evs_lag_nsec[EVENT_STATS_BUCKETS];
 };
 
 #define EV_TIMEOUT		(1 << 4)
@@ -63,23 +109,62 @@ struct event {
 #define EV_READ			(1 << 8)
 #define EV_WRITE		(1 << 9)
 #define EV_PERSIST		(1 << 10)
+#define EV_ET			(1 << 11)
+#define EV_EXCLUSIVE		(1 << 13)
 
 #define EVENT_FD(_ev)		((_ev)->ev_ident)
 
+#define EVENT_MAX_PRIORITIES	256
+
+#define EVLOOP_ONCE		0x01
+#define EVLOOP_NONBLOCK		0x02
+#define EVLOOP_NO_EXIT_ON_EMPTY	0x04
+
 struct event_base	*event_init(void);
 int			 event_dispatch(void);
+int			 event_loop(int);
+int			 event_loopexit(const struct timeval *);
+int			 event_loopbreak(void);
+
+struct event_base	*event_base_new(void);
+void			 event_base_free(struct event_base *);
+int			 event_base_dispatch(struct event_base *);
+int			 event_base_loop(struct event_base *, int);
+int			 event_base_loopexit(struct event_base *,
+			     const struct timeval *);
+int			 event_base_loopbreak(struct event_base *);
+int			 event_base_set(struct event_base *, struct event *);
+int			 event_base_wakeup(struct event_base *);
+int			 event_base_timer_wheel(struct event_base *,
+			     const struct timeval *);
+int			 event_base_timer_slack(struct event_base *,
+			     const struct timeval *);
+const struct timeval	*event_base_init_common_timeout(struct event_base *,
+			     const struct timeval *);
+int			 event_base_coarse_clock(struct event_base *, int);
+int			 event_base_get_stats(struct event_base *,
+			     struct event_stats *);
+int			 event_base_gettimeofday_cached(struct event_base *,
+			     struct timeval *);
 
 void			 event_set(struct event *, int, short,
 			     void (*)(int, short, void *), void *);
 int			 event_add(struct event *, const struct timeval *);
 int			 event_del(struct event *);
+int			 event_modify(struct event *, short);
 int			 event_pending(struct event *, short,
 			     struct timeval *);
 int			 event_initialized(struct event *);
+void			 event_active(struct event *, int);
+int			 event_priority_init(int);
+int			 event_base_priority_init(struct event_base *, int);
+int			 event_priority_set(struct event *, int);
 
 void			 evtimer_set(struct event *,
 			     void (*)(int, short, void *), void *);
 int			 evtimer_add(struct event *, const struct timeval *);
+int			 evtimer_add_slack(struct event *,
+			     const struct timeval *, const struct timeval *);
 int			 evtimer_del(struct event *);
 int			 evtimer_pending(struct event *, struct timeval *);
 int			 evtimer_initialized(struct event *);
@@ -90,5 +175,6 @@ int			 signal_add(struct event *, const struct timeval *);
 int			 signal_del(struct event *);
 int			 signal_pending(struct event *, struct timeval *);
 int			 signal_initialized(struct event *);
+int			 signal_siginfo(struct event *, struct event_siginfo *);
 
 #endif /* _LIB_EVENT_H_ */